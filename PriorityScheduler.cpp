@@ -33,6 +33,14 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <PriorityScheduler.h>
 #endif
 
+#if defined(SCHEDULER_HAS_FILE_DESCRIPTORS)
+#include <unistd.h>
+#endif
+
+#if defined(SCHEDULER_COUNTED_CRITICAL)
+volatile uint8_t scheduler_critical_depth = 0;   // How deeply critical sections are nested. See the header.
+#endif
+
 
 /****************************************************************************************************
 * Class-management functions...                                                                     *
@@ -44,10 +52,88 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 Scheduler::Scheduler() {
   this->next_pid            = 0x00000001;
   this->currently_executing = 0x00000000;
+  this->running_batch       = NULL;
+  this->running_batch_count = 0;
   this->schedule_root_node  = NULL;
   this->productive_loops    = 0x00000000;
   this->total_loops         = 0x00000000;
   this->overhead            = 0x00000000;
+  this->stats_sequence      = 0x00000000;
+  this->elapsed_ticks       = 0x00000000;
+  this->pid_index           = NULL;
+  this->pid_index_size      = 0;
+  this->schedule_count      = 0;
+  this->active_count        = 0;
+  this->tick_head           = NULL;
+  this->released_total      = 0;
+  this->cleared_total       = 0;
+  this->tick_micros         = 1000;
+  this->admission_bound     = 0;
+  this->admission_policy    = SCHEDULER_ADMIT_NONE;
+  this->dispatch_policy     = SCHEDULER_POLICY_LIST_ORDER;
+  memset(&this->ready_heap, 0x00, sizeof(ScheduleHeap));
+  this->ready_heap.order    = SCHEDULER_HEAP_VRUNTIME;
+  memset(&this->shed_heap, 0x00, sizeof(ScheduleHeap));
+  this->shed_heap.order     = SCHEDULER_HEAP_DENSITY;
+  this->shed_backlog        = 0x00000000;
+  this->shed_limit_micros   = 0x00000000;
+  this->shed_total          = 0x00000000;
+  this->min_vruntime        = 0x00000000;
+  this->fair_total_micros   = 0;
+  this->cyclic_jobs         = NULL;
+  this->cyclic_frame_start  = NULL;
+  this->cyclic_frames       = 0;
+  this->cyclic_minor        = 0x00000000;
+  this->cyclic_tick         = 0x00000000;
+  this->cyclic_frame_count  = 0x00000000;
+  this->cyclic_frame_tick   = 0x00000000;
+  this->cyclic_cursor_frame = 0x00000000;
+  this->cyclic_cursor_job   = 0;
+  this->cyclic_overruns     = 0x00000000;
+  this->crit_mode           = 0;
+  this->crit_last_trigger   = 0x00000000;
+  this->crit_lateness_ticks = 0x00000000;
+  this->crit_recovery_ticks = 1000;
+  this->crit_switch_count   = 0x00000000;
+  this->watchdog_armed      = false;
+  this->watchdog_started    = 0x00000000;
+  this->watchdog_deadline   = 0x00000000;
+  this->watchdog_open       = -1;
+  this->overrun_hook        = NULL;
+  this->overrun_count       = 0x00000000;
+  this->overrun_next        = 0;
+  memset(this->overrun_log, 0x00, sizeof(this->overrun_log));
+  this->sample_seed           = 0x2545F491;
+  this->profiler_overhead     = 0x00000000;
+  this->profiler_resolution   = 0x00000000;
+  this->profiler_calibrated   = false;
+  this->profiler_calibration_tries = 0;
+  this->anomaly_sigmas        = 0;
+  this->anomaly_shift_percent = 0;
+  this->anomaly_floor_micros  = 0x00000000;
+  this->anomaly_count         = 0x00000000;
+  this->anomaly_next          = 0;
+  memset(this->anomaly_log, 0x00, sizeof(this->anomaly_log));
+  this->idle_count            = 0;
+  this->idle_cursor           = 0;
+  this->idle_budget_micros    = 0x00000000;
+  this->idle_runs             = 0x00000000;
+  this->log_ring              = NULL;
+  this->log_slots             = 0;
+  this->log_head              = 0;
+  this->log_tail              = 0;
+  this->log_output            = NULL;
+  this->log_dropped           = 0x00000000;
+  this->dump_job              = NULL;
+  this->pwm                   = NULL;
+  this->post_head             = 0;
+  this->epoch_offset          = 0x00000000;
+  this->paused                = false;
+  this->absolute_deadlines    = false;
+  this->post_tail             = 0;
+  memset(this->post_ring, 0x00, sizeof(this->post_ring));
+  for (uint8_t i = 0; i < SCHEDULER_POST_SLOTS; i++) this->post_ring[i].sequence = i;
+  for (uint8_t i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) this->timeout_wheel[i] = NULL;
 }
 
 
@@ -55,7 +141,13 @@ Scheduler::Scheduler() {
 * Destructor.
 */
 Scheduler::~Scheduler() {
+  this->stopCyclicSchedule();
+  this->stopLogging();
+  this->cancelDump();
+  this->stopPwm();
   this->destroyAllScheduleItems();
+  this->heapFree(&this->ready_heap);
+  this->heapFree(&this->shed_heap);
 }
 
 
@@ -69,15 +161,19 @@ Scheduler::~Scheduler() {
 *  So to begin profiling a schedule, simply malloc() the appropriate struct into place and initialize it.
 */
 void Scheduler::beginProfiling(ScheduleItem *target) {
+  if (!this->profiler_calibrated && (this->profiler_calibration_tries < SCHEDULER_CALIBRATION_TRIES)) {
+    this->calibrateProfiler();
+  }
   if (target != NULL) {
     if (target->prof_data == NULL) {
       ScheduleProfile *p_data  = (ScheduleProfile *) malloc(sizeof(ScheduleProfile));
+      if (p_data == NULL) return;
+      memset(p_data, 0x00, sizeof(ScheduleProfile));
       target->prof_data = p_data;
       p_data->profiling_active  = true;
-      p_data->last_time_micros  = 0x00000000;
-      p_data->execution_count   = 0x00000000;
-      p_data->worst_time_micros = 0x00000000;
       p_data->best_time_micros  = 0xFFFFFFFF;
+      p_data->sample_rate       = 1;
+      p_data->sample_countdown  = 1;
     }
   }
 }
@@ -124,7 +220,7 @@ void Scheduler::clearProfilingData(ScheduleItem *obj) {
     ScheduleProfile *p_data  = obj->prof_data;
     if (p_data != NULL) {
       free(p_data);
-      p_data = NULL;
+      obj->prof_data = NULL;
     }
   }
 }
@@ -164,6 +260,438 @@ boolean Scheduler::scheduleBeingProfiled(uint32_t g_pid) {
 }
 
 
+/**
+* Stands in for a callback during calibration.
+*/
+static void calibration_callback() {
+}
+
+
+/**
+* Times SCHEDULER_CALIBRATION_RUNS dispatches of an empty callback, exactly as serviceScheduledEvents()
+*  would time a real one, and keeps the fastest as the profiler's overhead. Also finds the smallest step
+*  that micros() takes, so that dumps from different boards can be compared.
+*/
+void Scheduler::calibrateProfiler() {
+  ScheduleItem dummy;
+  memset(&dummy, 0x00, sizeof(ScheduleItem));
+  dummy.schedule_callback = calibration_callback;
+  uint32_t saved_pid  = this->currently_executing;
+  uint32_t fastest    = 0xFFFFFFFF;
+  // We may be called from a running callback. runSchedule() stops the watchdog, so set the caller's
+  //  aside until we are done. If it comes due meanwhile, the next tick catches it.
+  boolean  saved_armed;
+  uint32_t saved_started;
+  uint32_t saved_deadline;
+  int8_t   saved_open;
+  {
+    SCHEDULER_ENTER_CRITICAL();
+    saved_armed    = this->watchdog_armed;
+    saved_started  = this->watchdog_started;
+    saved_deadline = this->watchdog_deadline;
+    saved_open     = this->watchdog_open;
+    this->watchdog_armed = false;
+    this->watchdog_open  = -1;
+    SCHEDULER_EXIT_CRITICAL();
+  }
+  for (uint8_t i = 0; i < SCHEDULER_CALIBRATION_RUNS; i++) {
+    uint32_t start_time  = micros();
+    this->runSchedule(&dummy, NULL, 0);
+    uint32_t elapsed     = micros() - start_time;
+    if (elapsed < fastest) fastest = elapsed;
+  }
+  {
+    SCHEDULER_ENTER_CRITICAL();
+    this->watchdog_started  = saved_started;
+    this->watchdog_deadline = saved_deadline;
+    this->watchdog_open     = saved_open;
+    this->watchdog_armed    = saved_armed;
+    this->currently_executing = saved_pid;
+    SCHEDULER_EXIT_CRITICAL();
+  }
+
+  // Watch for two changes of micros(), and take the second (the first is likely a partial step).
+  uint32_t resolution  = 0;
+  uint32_t last        = micros();
+  for (uint8_t steps = 0; steps < 2; ) {
+    uint32_t now  = micros();
+    uint32_t spin = 0;
+    while ((now == last) && (++spin < 100000)) now = micros();
+    if (now == last) break;   // The clock isn't running (yet).
+    resolution = now - last;
+    last = now;
+    steps++;
+  }
+
+  this->profiler_overhead   = fastest;
+  this->profiler_resolution = resolution;
+  this->profiler_calibrated = (resolution > 0);
+  if (!this->profiler_calibrated) this->profiler_calibration_tries++;
+}
+
+
+uint32_t Scheduler::getProfilerOverhead() {
+  return this->profiler_overhead;
+}
+
+
+uint32_t Scheduler::getProfilerResolution() {
+  return this->profiler_resolution;
+}
+
+
+/**
+* Only time one in every rate runs of the given schedule. See Note 7. Starts profiling the schedule if
+*  it isn't already. Returns false if the PID isn't found (or rate is 0).
+*/
+boolean Scheduler::setProfilingSampleRate(uint32_t g_pid, uint16_t rate, boolean random) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if ((nu_sched != NULL) && (rate > 0)) {
+    this->beginProfiling(nu_sched);
+    if (nu_sched->prof_data != NULL) {
+      nu_sched->prof_data->sample_rate      = rate;
+      nu_sched->prof_data->sample_random    = random;
+      nu_sched->prof_data->sample_countdown = 1;   // Time the next run, and count from there.
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* Decides whether the coming run of a profiled schedule is to be timed.
+*/
+boolean Scheduler::sampleThisRun(ScheduleProfile *p_data) {
+  if (--p_data->sample_countdown > 0) return false;
+  if (p_data->sample_random && (p_data->sample_rate > 1)) {
+    this->sample_seed ^= this->sample_seed << 13;
+    this->sample_seed ^= this->sample_seed >> 17;
+    this->sample_seed ^= this->sample_seed << 5;
+    p_data->sample_countdown = 1 + (this->sample_seed % ((2 * (uint32_t) p_data->sample_rate) - 1));
+  }
+  else {
+    p_data->sample_countdown = p_data->sample_rate;
+  }
+  return true;
+}
+
+
+/**
+* Counts a run that wasn't timed.
+*/
+void Scheduler::recordUnsampledRun(ScheduleProfile *p_data) {
+  p_data->sequence++;
+  SCHEDULER_BARRIER();
+  p_data->execution_count++;
+  SCHEDULER_BARRIER();
+  p_data->sequence++;
+}
+
+
+/**
+* Total execution time, scaled up to account for the runs that weren't timed.
+*/
+uint64_t Scheduler::scaledTotalTime(ScheduleProfile *p_data) {
+  if ((p_data->sample_count == 0) || (p_data->sample_count == p_data->execution_count)) {
+    return p_data->total_time_micros;
+  }
+  uint64_t whole  = p_data->total_time_micros / p_data->sample_count;
+  uint64_t part   = p_data->total_time_micros % p_data->sample_count;
+  return (whole * p_data->execution_count) + ((part * p_data->execution_count) / p_data->sample_count);
+}
+
+
+/**
+* Half-width of the ~95% confidence interval on scaledTotalTime(), in parts-per-thousand of it. Zero if
+*  every run was timed. 1.96 * sigma / (mean * sqrt(samples)), using the moving variance.
+*/
+uint32_t Scheduler::samplingConfidence(ScheduleProfile *p_data) {
+  if ((p_data->sample_count >= p_data->execution_count) || (p_data->sample_count == 0)) return 0;
+  uint32_t mean  = p_data->ewma_mean_x16 >> 4;
+  if (mean == 0) return 1000;
+  uint32_t sigma = 0;
+  uint32_t root  = 0;
+  // Integer square roots, by bisection on the bits.
+  for (int8_t bit = 15; bit >= 0; bit--) {
+    uint32_t trial  = sigma | (1UL << bit);
+    if (trial * trial <= p_data->ewma_variance) sigma = trial;
+    trial = root | (1UL << bit);
+    if (trial * trial <= p_data->sample_count) root = trial;
+  }
+  uint64_t return_value  = ((uint64_t) sigma * 1960) / ((uint64_t) mean * root);
+  return (return_value > 1000) ? 1000 : (uint32_t) return_value;
+}
+
+
+/**
+* Folds one run of the given (profiled) schedule into its profiling data.
+*/
+void Scheduler::recordProfile(ScheduleItem *obj, uint32_t exec_micros, uint32_t lateness, uint32_t now) {
+  ScheduleProfile *p_data  = obj->prof_data;
+  uint8_t bucket  = 0;
+  uint8_t late_bucket  = 0;
+  while ((exec_micros >> bucket) && (bucket < (SCHEDULER_HISTOGRAM_BUCKETS - 1))) bucket++;
+  while ((lateness >> late_bucket) && (late_bucket < (SCHEDULER_LATENESS_BUCKETS - 1))) late_bucket++;
+  p_data->sequence++;
+  SCHEDULER_BARRIER();
+  p_data->last_time_micros   = exec_micros;
+  p_data->worst_time_micros  = max(p_data->worst_time_micros, exec_micros);
+  p_data->best_time_micros   = min(p_data->best_time_micros, exec_micros);
+  p_data->worst_lateness     = max(p_data->worst_lateness, lateness);
+  p_data->total_time_micros += exec_micros;
+  p_data->total_lateness    += lateness;
+  p_data->histogram[bucket]++;
+  p_data->lateness_histogram[late_bucket]++;
+  p_data->execution_count++;
+  p_data->sample_count++;
+  this->detectAnomalies(obj, exec_micros, now);
+  SCHEDULER_BARRIER();
+  p_data->sequence++;
+}
+
+
+/**
+* Updates the moving average and variance of the given schedule's execution time, and logs the run
+*  if it looks anomalous. See Note 6. O(1), and integer-only. Called with the profile's sequence odd.
+*/
+void Scheduler::detectAnomalies(ScheduleItem *obj, uint32_t exec_micros, uint32_t now) {
+  ScheduleProfile *p_data  = obj->prof_data;
+  // Runs longer than about 134 seconds are counted as that long, so the 1/16ths stay in 31 bits.
+  uint32_t sample    = (exec_micros > 0x07FFFFFF) ? 0x07FFFFFF : exec_micros;
+  if (p_data->sample_count == 1) {
+    p_data->ewma_mean_x16 = sample << 4;   // Seed the average with the first run.
+    return;
+  }
+  uint32_t mean      = p_data->ewma_mean_x16 >> 4;
+  int32_t  deviation = (int32_t) (sample - mean);
+  uint32_t distance  = (deviation < 0) ? (uint32_t) -deviation : (uint32_t) deviation;
+  if (distance > 0xFFFF) distance = 0xFFFF;     // Keeps the square in 32 bits.
+  uint32_t square    = distance * distance;
+
+  if ((this->anomaly_sigmas > 0) && (p_data->sample_count > 16) && (distance > this->anomaly_floor_micros)) {
+    uint32_t k_squared  = (uint32_t) this->anomaly_sigmas * this->anomaly_sigmas;
+    if ((p_data->ewma_variance <= (0xFFFFFFFF / k_squared)) && (square > (k_squared * p_data->ewma_variance))) {
+      this->logAnomaly(obj->pid, now, exec_micros, mean, SCHEDULER_ANOMALY_OUTLIER);
+    }
+  }
+
+  // Weight 1/16 for both. The mean is kept in 1/16ths so that small changes aren't lost to rounding.
+  int32_t  mean_step = ((int32_t) (sample << 4) - (int32_t) p_data->ewma_mean_x16) / 16;
+  p_data->ewma_mean_x16 += mean_step;
+  if (square > p_data->ewma_variance) p_data->ewma_variance += (square - p_data->ewma_variance) >> 4;
+  else p_data->ewma_variance -= (p_data->ewma_variance - square) >> 4;
+
+  if ((this->anomaly_sigmas > 0) && (this->anomaly_shift_percent > 0) && (p_data->baseline_mean_x16 > 0)) {
+    uint32_t baseline  = p_data->baseline_mean_x16;
+    uint32_t drift     = (p_data->ewma_mean_x16 > baseline) ? (p_data->ewma_mean_x16 - baseline) : (baseline - p_data->ewma_mean_x16);
+    if (((uint64_t) drift * 100) > ((uint64_t) baseline * this->anomaly_shift_percent)) {
+      if (p_data->regression_runs < 0xFF) p_data->regression_runs++;
+      if (p_data->regression_runs == SCHEDULER_REGRESSION_RUNS) {
+        this->logAnomaly(obj->pid, now, p_data->ewma_mean_x16 >> 4, baseline >> 4, SCHEDULER_ANOMALY_REGRESSION);
+      }
+    }
+    else {
+      p_data->regression_runs = 0;
+    }
+  }
+}
+
+
+void Scheduler::logAnomaly(uint32_t pid, uint32_t now, uint32_t observed, uint32_t expected, uint8_t kind) {
+  ScheduleAnomaly *event  = &this->anomaly_log[this->anomaly_next];
+  event->pid       = pid;
+  event->timestamp = now;
+  event->observed  = observed;
+  event->expected  = expected;
+  event->kind      = kind;
+  this->anomaly_next = (this->anomaly_next + 1) % SCHEDULER_ANOMALY_LOG;
+  this->anomaly_count++;
+}
+
+
+/**
+* Turns anomaly detection on (sigmas > 0) or off (sigmas == 0). See Note 6.
+*/
+void Scheduler::setAnomalyDetection(uint8_t sigmas, uint8_t shift_percent, uint32_t floor_micros) {
+  this->anomaly_sigmas        = sigmas;
+  this->anomaly_shift_percent = shift_percent;
+  this->anomaly_floor_micros  = floor_micros;
+}
+
+
+/**
+* Remembers the current moving average of the given schedule's execution time (or every profiled
+*  schedule's, if g_pid is 0) as the baseline for regression detection.
+*/
+void Scheduler::saveProfilingBaseline(uint32_t g_pid) {
+  ScheduleItem *current  = (g_pid == 0) ? this->schedule_root_node : findNodeByPID(g_pid);
+  while (current != NULL) {
+    if (current->prof_data != NULL) {
+      current->prof_data->baseline_mean_x16 = current->prof_data->ewma_mean_x16;
+      current->prof_data->regression_runs   = 0;
+    }
+    current = (g_pid == 0) ? current->next : NULL;
+  }
+}
+
+
+uint32_t Scheduler::getAnomalyCount() {
+  return this->anomaly_count;
+}
+
+
+/**
+* Copies up to max_events of the most recent anomalies into out, oldest first.
+*  Returns the number copied.
+*/
+uint8_t Scheduler::getAnomalies(ScheduleAnomaly* out, uint8_t max_events) {
+  uint8_t available  = (this->anomaly_count < SCHEDULER_ANOMALY_LOG) ? this->anomaly_count : SCHEDULER_ANOMALY_LOG;
+  uint8_t count      = (available < max_events) ? available : max_events;
+  for (uint8_t i = 0; i < count; i++) {
+    out[i] = this->anomaly_log[(this->anomaly_next + SCHEDULER_ANOMALY_LOG - count + i) % SCHEDULER_ANOMALY_LOG];
+  }
+  return count;
+}
+
+
+/**
+* The value of the given SCHEDULER_RANK_* metric for the given (profiled) schedule.
+*/
+uint32_t Scheduler::rankValue(ScheduleItem *obj, uint8_t metric, uint64_t total_time) {
+  ScheduleProfile *p_data  = obj->prof_data;
+  switch (metric) {
+    case SCHEDULER_RANK_CPU_SHARE:
+      return (total_time > 0) ? (uint32_t) ((this->scaledTotalTime(p_data) * 1000000ULL) / total_time) : 0;
+    case SCHEDULER_RANK_WORST:
+      return p_data->worst_time_micros;
+    case SCHEDULER_RANK_P99:
+      {
+        // Walk down from the top until we have seen the slowest 1% of runs.
+        uint32_t tail  = 0;
+        uint32_t limit = p_data->sample_count / 100;
+        for (int8_t i = SCHEDULER_HISTOGRAM_BUCKETS - 1; i > 0; i--) {
+          tail += p_data->histogram[i];
+          if (tail > limit) {
+            return (i == (SCHEDULER_HISTOGRAM_BUCKETS - 1)) ? p_data->worst_time_micros : ((1UL << i) - 1);
+          }
+        }
+      }
+      return 0;
+    case SCHEDULER_RANK_LATENESS:
+      return p_data->worst_lateness;
+    case SCHEDULER_RANK_EXECUTIONS:
+      return p_data->execution_count;
+  }
+  return 0;
+}
+
+
+/**
+* Finds the max_count profiled schedules with the highest value of the given metric, without sorting
+*  (or formatting) the whole list. out is used as a min-heap of the best so far, so that each schedule
+*  costs at most O(log k). It is heap-sorted into descending order at the end.
+*/
+uint8_t Scheduler::getTopSchedules(ScheduleRank* out, uint8_t max_count, uint8_t metric) {
+  uint8_t count  = 0;
+  uint64_t total_time  = 0;
+  ScheduleItem *current;
+  if ((out == NULL) || (max_count == 0)) return 0;
+
+  if (metric == SCHEDULER_RANK_CPU_SHARE) {
+    for (current = this->schedule_root_node; current != NULL; current = current->next) {
+      if (current->prof_data != NULL) total_time += this->scaledTotalTime(current->prof_data);
+    }
+  }
+
+  for (current = this->schedule_root_node; current != NULL; current = current->next) {
+    if (current->prof_data == NULL) continue;
+    ScheduleRank candidate;
+    candidate.pid   = current->pid;
+    candidate.value = this->rankValue(current, metric, total_time);
+    uint8_t i;
+    if (count < max_count) {
+      i = count++;   // Sift up.
+      while ((i > 0) && (out[(i - 1) >> 1].value > candidate.value)) {
+        out[i] = out[(i - 1) >> 1];
+        i = (i - 1) >> 1;
+      }
+      out[i] = candidate;
+    }
+    else if (candidate.value > out[0].value) {
+      i = 0;         // Replace the smallest, and sift down.
+      while (true) {
+        uint8_t child  = (i << 1) + 1;
+        if (child >= count) break;
+        if ((child + 1 < count) && (out[child + 1].value < out[child].value)) child++;
+        if (out[child].value >= candidate.value) break;
+        out[i] = out[child];
+        i = child;
+      }
+      out[i] = candidate;
+    }
+  }
+
+  // Heap-sort. Repeatedly moving the smallest to the end leaves the array highest-first.
+  for (uint8_t end = count; end > 1; end--) {
+    ScheduleRank last  = out[end - 1];
+    out[end - 1] = out[0];
+    uint8_t i = 0;
+    while (true) {
+      uint8_t child  = (i << 1) + 1;
+      if (child >= end - 1) break;
+      if ((child + 1 < end - 1) && (out[child + 1].value < out[child].value)) child++;
+      if (out[child].value >= last.value) break;
+      out[i] = out[child];
+      i = child;
+    }
+    out[i] = last;
+  }
+  return count;
+}
+
+
+/**
+* Copies the given schedule's profiling data into out, in a state that the profiler actually
+*  left it in. Returns false if there is no such data, or the writer kept getting in the way.
+*/
+boolean Scheduler::snapshotProfile(uint32_t g_pid, ScheduleProfile* out) {
+  return this->copyProfile(findNodeByPID(g_pid), out);
+}
+
+boolean Scheduler::copyProfile(ScheduleItem *obj, ScheduleProfile* out) {
+  if ((obj != NULL) && (obj->prof_data != NULL)) {
+    ScheduleProfile *p_data  = obj->prof_data;
+    for (uint8_t i = 0; i < SCHEDULER_SNAPSHOT_RETRIES; i++) {
+      uint32_t before  = p_data->sequence;
+      SCHEDULER_BARRIER();
+      *out = *p_data;
+      SCHEDULER_BARRIER();
+      if (((before & 1) == 0) && (before == p_data->sequence)) return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* Copies the scheduler's loop counters into out, in a state that serviceScheduledEvents()
+*  actually left them in. Returns false if the writer kept getting in the way.
+*/
+boolean Scheduler::snapshotStats(SchedulerStats* out) {
+  for (uint8_t i = 0; i < SCHEDULER_SNAPSHOT_RETRIES; i++) {
+    uint32_t before  = this->stats_sequence;
+    SCHEDULER_BARRIER();
+    out->productive_loops = this->productive_loops;
+    out->total_loops      = this->total_loops;
+    out->overhead         = this->overhead;
+    SCHEDULER_BARRIER();
+    if (((before & 1) == 0) && (before == this->stats_sequence)) return true;
+  }
+  return false;
+}
+
+
 
 /****************************************************************************************************
 * Linked-list helper functions...                                                                   *
@@ -173,13 +701,7 @@ boolean Scheduler::scheduleBeingProfiled(uint32_t g_pid) {
 * Returns the number of schedules presently defined.
 */
 uint16_t Scheduler::getTotalSchedules() {
-  uint16_t return_value = 0;
-  ScheduleItem *current  = this->schedule_root_node;
-  while (current != NULL) {
-    return_value++;
-    current = current->next;
-  }
-  return return_value;
+  return this->schedule_count;
 }
 
 
@@ -187,13 +709,16 @@ uint16_t Scheduler::getTotalSchedules() {
 * Returns the number of schedules presently active.
 */
 uint16_t Scheduler::getActiveSchedules() {
-  uint16_t return_value = 0;
-  ScheduleItem *current  = this->schedule_root_node;
-  while (current != NULL) {
-    if (current->thread_enabled) return_value++;
-    current = current->next;
-  }
-  return return_value;
+  return this->active_count;
+}
+
+
+
+/**
+* Returns the number of schedules that have fired, but not yet been serviced.
+*/
+uint16_t Scheduler::getPendingSchedules() {
+  return (uint16_t) (this->released_total - this->cleared_total);
 }
 
 
@@ -207,10 +732,27 @@ void Scheduler::destroyAllScheduleItems() {
   ScheduleItem *temp1;
   while (temp0 != NULL) {
     temp1  = temp0->next;
+    this->clearBudgetData(temp0);
+    if (temp0->params != NULL) free(temp0->params);
     this->clearProfilingData(temp0);
     free(temp0);
     temp0 = temp1;
   }
+  this->cancelDump();                 // It would be left pointing into the list.
+  this->schedule_root_node = NULL;
+  this->schedule_count     = 0;
+  this->active_count       = 0;
+  this->tick_head          = NULL;
+  this->cleared_total      = this->released_total;
+  this->ready_heap.count   = 0;
+  this->shed_heap.count    = 0;
+  this->shed_backlog       = 0;
+  for (uint8_t i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) this->timeout_wheel[i] = NULL;
+  if (this->pid_index != NULL) {
+    free(this->pid_index);
+    this->pid_index      = NULL;
+    this->pid_index_size = 0;
+  }
 }
 
 
@@ -221,6 +763,7 @@ boolean Scheduler::insertScheduleItemAfterNode(ScheduleItem *nu, ScheduleItem *p
   if (prev != NULL) {
     nu->next    = prev->next;
     prev->next  = nu;
+    this->indexScheduleItem(nu);
     return true;
   }
   return false;
@@ -232,16 +775,22 @@ boolean Scheduler::insertScheduleItemAfterNode(ScheduleItem *nu, ScheduleItem *p
 *  Returns true on success, and false on failure. Should never return false if good parameters are given.
 */
 boolean Scheduler::insertScheduleItemAtEnd(ScheduleItem *nu) {
-  if (this->schedule_root_node != NULL) {
-    ScheduleItem *temp  = this->schedule_root_node;
+  boolean return_value  = false;
+  this->indexScheduleItem(nu);
+  ScheduleItem *temp  = this->schedule_root_node;
+  if (temp != NULL) {
     while (temp->next != NULL) temp  = temp->next;
+  }
+  SCHEDULER_ENTER_CRITICAL();      // Without an index, findNodeByPID() walks the list, maybe from an ISR.
+  if (temp != NULL) {
     temp->next  = nu;
-    return true;
+    return_value = true;
   }
   else {
     this->schedule_root_node = nu;
   }
-  return false;
+  SCHEDULER_EXIT_CRITICAL();
+  return return_value;
 }
 
 
@@ -250,6 +799,17 @@ boolean Scheduler::insertScheduleItemAtEnd(ScheduleItem *nu) {
 * Returns NULL if a node is not found that meets this criteria.
 */
 ScheduleItem* Scheduler::findNodeByPID(uint32_t g_pid) {
+  if (this->pid_index != NULL) {
+    ScheduleItem *current  = this->pid_index[g_pid & (this->pid_index_size - 1)];
+    while (current != NULL) {
+      if (current->pid == g_pid) {
+        return current;
+      }
+      current  = current->pid_next;
+    }
+    return NULL;
+  }
+  // No index (we couldn't malloc() one). Fall back to walking the list.
   ScheduleItem *current  = this->schedule_root_node;
   while (current != NULL) {
     if (current->pid == g_pid) {
@@ -261,6 +821,77 @@ ScheduleItem* Scheduler::findNodeByPID(uint32_t g_pid) {
 }
 
 
+/**
+* Adds the given node to the PID index, growing the index if it has become crowded.
+* PIDs are handed out sequentially, so masking off the low bits spreads them evenly.
+* The ready and shed heaps must already have room for it. See reserveHeaps().
+*/
+void Scheduler::indexScheduleItem(ScheduleItem *obj) {
+  this->schedule_count++;
+  if ((this->pid_index == NULL) || (this->schedule_count > this->pid_index_size)) {
+    this->growPIDIndex();
+  }
+  SCHEDULER_ENTER_CRITICAL();      // findNodeByPID() may be called from an ISR.
+  if (this->pid_index != NULL) {
+    uint16_t bucket  = obj->pid & (this->pid_index_size - 1);
+    obj->pid_next    = this->pid_index[bucket];
+    this->pid_index[bucket] = obj;
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Removes the given node from the PID index.
+*/
+void Scheduler::unindexScheduleItem(ScheduleItem *obj) {
+  this->schedule_count--;
+  SCHEDULER_ENTER_CRITICAL();      // findNodeByPID() may be called from an ISR.
+  if (this->pid_index != NULL) {
+    ScheduleItem **link  = &this->pid_index[obj->pid & (this->pid_index_size - 1)];
+    while (*link != NULL) {
+      if (*link == obj) {
+        *link = obj->pid_next;
+        break;
+      }
+      link = &(*link)->pid_next;
+    }
+  }
+  obj->pid_next = NULL;
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Doubles the number of buckets in the PID index and re-files every node. If we can't get
+*  the memory, we carry on with the index we have (or the list walk, if we have none).
+*  The chains are intrusive, so re-filing rewires the live ones. That (and the swap) is done with
+*  interrupts held off, so an ISR calling findNodeByPID() sees either the old index or the new one.
+*  It only happens when the number of schedules doubles.
+*/
+void Scheduler::growPIDIndex() {
+  uint16_t nu_size  = (this->pid_index_size == 0) ? SCHEDULER_PID_BUCKETS : (this->pid_index_size << 1);
+  if (nu_size <= this->pid_index_size) return;   // Would overflow. Live with longer chains.
+  ScheduleItem **nu_index  = (ScheduleItem **) malloc(sizeof(ScheduleItem*) * nu_size);
+  if (nu_index != NULL) {
+    memset(nu_index, 0x00, sizeof(ScheduleItem*) * nu_size);
+    ScheduleItem **old_index  = this->pid_index;
+    SCHEDULER_ENTER_CRITICAL();
+    ScheduleItem *current  = this->schedule_root_node;
+    while (current != NULL) {
+      uint16_t bucket    = current->pid & (nu_size - 1);
+      current->pid_next  = nu_index[bucket];
+      nu_index[bucket]   = current;
+      current = current->next;
+    }
+    this->pid_index      = nu_index;
+    this->pid_index_size = nu_size;
+    SCHEDULER_EXIT_CRITICAL();
+    if (old_index != NULL) free(old_index);
+  }
+}
+
+
 /**
 * Traverses the linked list and returns a pointer to the node that has target as its "->next" member.
 * Returns NULL if a node is not found that meets this criteria.
@@ -287,14 +918,36 @@ ScheduleItem* Scheduler::findNodeBeforeThisOne(ScheduleItem *target) {
 */
 void Scheduler::destroyScheduleItem(ScheduleItem *r_node) {
   if (r_node != NULL) {
+    if (this->inCyclicSchedule(r_node)) this->stopCyclicSchedule();   // The table would be left pointing at it.
+    this->setEnabled(r_node, false);
+    this->clearRelease(r_node);
+    if ((this->dump_job != NULL) && (this->dump_job->cursor == r_node)) this->dump_job->cursor = r_node->next;
     ScheduleItem *current  = this->findNodeBeforeThisOne(r_node);
-    if (current != NULL) {          // Did we find a place to put our "->next" ref?
-      current->next = r_node->next;
+    {
+      SCHEDULER_ENTER_CRITICAL();   // Without an index, findNodeByPID() walks the list, maybe from an ISR.
+      if (current != NULL) {        // Did we find a place to put our "->next" ref?
+        current->next = r_node->next;
+      }
+      else if (r_node == this->schedule_root_node) {  // Special-case, the root node is being destroyed.
+        this->schedule_root_node = r_node->next;
+      }
+      SCHEDULER_EXIT_CRITICAL();
     }
-    else if (r_node == this->schedule_root_node) {    // Special-case, the root node is being destroyed.
-      this->schedule_root_node = r_node->next;
+    this->unindexScheduleItem(r_node);
+    if (r_node->in_wheel) {
+      SCHEDULER_ENTER_CRITICAL();
+      this->unlinkFromWheel(r_node);
+      SCHEDULER_EXIT_CRITICAL();
+    }
+    if ((r_node->ready_pos != 0) || (r_node->shed_pos != 0)) {
+      SCHEDULER_ENTER_CRITICAL();
+      this->heapRemove(&this->ready_heap, r_node);
+      this->shedRemove(r_node);
+      SCHEDULER_EXIT_CRITICAL();
     }
     // We are now free to free()...
+    this->clearBudgetData(r_node);
+    if (r_node->params != NULL) free(r_node->params);
     this->clearProfilingData(r_node);
     free(r_node);
   }
@@ -330,23 +983,29 @@ uint32_t Scheduler::peekNextPID() {
 *  Returns the newly-created PID on success, or 0 on failure.
 */
 uint32_t Scheduler::createSchedule(uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback) {
+  return this->createSchedule(sch_period, recurrence, ac, sch_callback, 0);
+}
+
+
+/**
+*  As above, but also declares how long the callback takes to run (in microseconds), for the sake of
+*    admission control. If admission control is on and the new schedule doesn't fit, returns 0.
+*/
+uint32_t Scheduler::createSchedule(uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback, uint32_t exec_estimate_micros) {
   uint32_t return_value  = 0;
-  if (sch_period > 1) {
-    if (sch_callback != NULL) {
-      ScheduleItem *nu_sched = (ScheduleItem *) malloc(sizeof(ScheduleItem));
-      if (nu_sched != NULL) {  // Did we actually malloc() successfully?
-        memset(nu_sched, 0x00, sizeof(ScheduleItem));
-        nu_sched->pid  = this->get_valid_new_pid();
-        nu_sched->thread_enabled      = true;    // Note: Enables immediately.
-        nu_sched->thread_fire         = false;
-        nu_sched->thread_recurs       = recurrence;
-        nu_sched->thread_period       = sch_period;
-        nu_sched->next                = NULL;
-        nu_sched->thread_time_to_wait = sch_period;
-        nu_sched->autoclear           = ac;
-        nu_sched->schedule_callback   = sch_callback;
-        return_value  = nu_sched->pid;
-        this->insertScheduleItemAtEnd(nu_sched);
+  if ((sch_callback != NULL) && this->admits(NULL, exec_estimate_micros, sch_period)) {
+    ScheduleItem *nu_sched = this->newScheduleItem(sch_period, recurrence, ac, sch_callback);
+    if (nu_sched != NULL) {
+      return_value  = nu_sched->pid;
+      if (exec_estimate_micros > 0) {
+        ScheduleParams *p_data  = this->getParams(nu_sched);
+        if (p_data != NULL) {
+          p_data->exec_estimate_micros = exec_estimate_micros;
+        }
+        else {
+          this->destroyScheduleItem(nu_sched);   // It was admitted on an estimate we can't keep.
+          return_value  = 0;
+        }
       }
     }
   }
@@ -355,63 +1014,247 @@ uint32_t Scheduler::createSchedule(uint32_t sch_period, int16_t recurrence, bool
 
 
 /**
-* Call this function to alter a given schedule. Set with the given period, a given number of times, with a given function call.
-*  Returns true on success or false if the given PID is not found, or there is a problem with the parameters.
+*  Call this function to create a new batch schedule. See Note 13 in the header.
 *
-* Will not set the schedule active, but will clear any pending executions for this schedule, as well as reset the timer for it.
+*  Returns the newly-created PID on success, or 0 on failure.
 */
-boolean Scheduler::alterSchedule(ScheduleItem *obj, uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback) {
-  boolean return_value  = false;
-  if (sch_period > 1) {
-    if (sch_callback != NULL) {
-      if (obj != NULL) {
-        obj->thread_fire         = false;
-        obj->thread_recurs       = recurrence;
-        obj->thread_period       = sch_period;
-        obj->thread_time_to_wait = sch_period;
-        obj->autoclear           = ac;
-        obj->schedule_callback   = sch_callback;
-        return_value  = true;
+uint32_t Scheduler::createBatchSchedule(uint32_t sch_period, int16_t recurrence, boolean ac, BatchFunctionPointer batch_callback, void* context) {
+  uint32_t return_value  = 0;
+  if ((batch_callback != NULL) && this->admits(NULL, 0, sch_period)) {
+    ScheduleItem *nu_sched = this->newScheduleItem(sch_period, recurrence, ac, NULL);
+    if (nu_sched != NULL) {
+      ScheduleParams *p_data  = this->getParams(nu_sched);
+      if (p_data != NULL) {
+        p_data->batch_callback = batch_callback;
+        p_data->context        = context;
+        return_value  = nu_sched->pid;
+      }
+      else {
+        this->destroyScheduleItem(nu_sched);
       }
     }
   }
   return return_value;
 }
 
-boolean Scheduler::alterSchedule(uint32_t g_pid, uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback) {
-  return this->alterSchedule(findNodeByPID(g_pid), sch_period, recurrence, ac, sch_callback);
-}
 
-boolean Scheduler::alterSchedule(uint32_t schedule_index, boolean ac) {
-  boolean return_value  = false;
-  ScheduleItem *nu_sched  = findNodeByPID(schedule_index);
-  if (nu_sched != NULL) {
-    nu_sched->autoclear = ac;
-    return_value  = true;
-  }
-  return return_value;
+/**
+* Makes sure that the heaps of the active dispatch policy and load shedding have room for the given
+*  number of schedules. Returns false if one couldn't grow. The configuration is left as it was.
+*/
+boolean Scheduler::reserveHeaps(uint16_t schedules) {
+  if ((this->ready_heap.items != NULL) && !this->heapGrow(&this->ready_heap, schedules)) return false;
+  if ((this->shed_heap.items != NULL) && !this->heapGrow(&this->shed_heap, schedules)) return false;
+  return true;
 }
 
-boolean Scheduler::alterSchedule(uint32_t schedule_index, FunctionPointer sch_callback) {
-  boolean return_value  = false;
-  if (sch_callback != NULL) {
-    ScheduleItem *nu_sched  = findNodeByPID(schedule_index);
-    if (nu_sched != NULL) {
+
+/**
+*  Allocates, fills and appends a new schedule. The callback is not checked, because some kinds of
+*    schedule (child schedulers, for instance) don't have one.
+*  Returns the new node on success, or NULL on failure (including when the heaps of the active
+*    policy can't grow to take it).
+*/
+ScheduleItem* Scheduler::newScheduleItem(uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback) {
+  ScheduleItem *nu_sched = NULL;
+  if ((sch_period > 1) && this->reserveHeaps(this->schedule_count + 1)) {
+    nu_sched = (ScheduleItem *) malloc(sizeof(ScheduleItem));
+    if (nu_sched != NULL) {  // Did we actually malloc() successfully?
+      memset(nu_sched, 0x00, sizeof(ScheduleItem));
+      nu_sched->pid  = this->get_valid_new_pid();
+      nu_sched->thread_fire         = false;
+      nu_sched->thread_recurs       = recurrence;
+      nu_sched->thread_period       = sch_period;
+      nu_sched->next                = NULL;
+      nu_sched->thread_time_to_wait = sch_period;
+      nu_sched->autoclear           = ac;
       nu_sched->schedule_callback   = sch_callback;
-      return_value  = true;
+      this->insertScheduleItemAtEnd(nu_sched);
+      this->setEnabled(nu_sched, true);    // Note: Enables immediately.
+    }
+  }
+  return nu_sched;
+}
+
+
+/**
+*  Call this function to create a new timeout schedule. It fires once, timeout ticks from now, unless
+*    it is re-armed with delaySchedule() or disabled first. Re-arming and disabling are O(1).
+*
+*  Returns the newly-created PID on success, or 0 on failure.
+*/
+uint32_t Scheduler::createTimeout(uint32_t timeout, boolean ac, FunctionPointer sch_callback) {
+  uint32_t return_value  = 0;
+  if ((sch_callback != NULL) && this->admits(NULL, 0, timeout)) {
+    ScheduleItem *nu_sched = this->newScheduleItem(timeout, 0, ac, sch_callback);
+    if (nu_sched != NULL) {
+      nu_sched->thread_mode = SCHEDULE_MODE_TIMEOUT;
+      this->armTimeout(nu_sched, timeout);
+      return_value  = nu_sched->pid;
     }
   }
   return return_value;
 }
 
-boolean Scheduler::alterSchedulePeriod(uint32_t schedule_index, uint32_t sch_period) {
+
+/**
+*  Call this function to run another Scheduler as a task of this one, on a CPU budget. See Note 4.
+*
+*  Returns the newly-created PID on success, or 0 on failure.
+*/
+uint32_t Scheduler::createChildSchedule(Scheduler* child, uint32_t budget_micros, uint32_t replenish_period) {
+  uint32_t return_value  = 0;
+  if ((child != NULL) && (child != this) && (budget_micros > 0) && this->admits(NULL, budget_micros, replenish_period)) {
+    ScheduleBudget *b_data  = (ScheduleBudget *) malloc(sizeof(ScheduleBudget));
+    if (b_data != NULL) {
+      ScheduleItem *nu_sched = this->newScheduleItem(replenish_period, -1, false, NULL);
+      if (nu_sched != NULL) {
+        memset(b_data, 0x00, sizeof(ScheduleBudget));
+        b_data->child            = child;
+        b_data->budget_micros    = budget_micros;
+        b_data->remaining_micros = (int32_t) budget_micros;
+        nu_sched->budget_data    = b_data;
+        return_value  = nu_sched->pid;
+      }
+      else {
+        free(b_data);
+      }
+    }
+  }
+  return return_value;
+}
+
+
+/**
+*  Call this function to create a server for aperiodic jobs, with the given budget. See Note 4.
+*
+*  Returns the newly-created PID on success, or 0 on failure.
+*/
+uint32_t Scheduler::createServer(uint32_t sch_period, uint32_t budget_micros, uint8_t queue_length, boolean sporadic) {
+  uint32_t return_value  = 0;
+  if ((budget_micros > 0) && (queue_length > 0) && (queue_length < 0xFF) && this->admits(NULL, budget_micros, sch_period)) {
+    ScheduleBudget *b_data  = (ScheduleBudget *) malloc(sizeof(ScheduleBudget));
+    FunctionPointer *queue  = (FunctionPointer *) malloc(sizeof(FunctionPointer) * (queue_length + 1));
+    ScheduleItem *nu_sched  = NULL;
+    if ((b_data != NULL) && (queue != NULL)) {
+      nu_sched = this->newScheduleItem(sch_period, -1, false, NULL);
+    }
+    if (nu_sched != NULL) {
+      memset(b_data, 0x00, sizeof(ScheduleBudget));
+      b_data->budget_micros    = budget_micros;
+      b_data->remaining_micros = (int32_t) budget_micros;
+      b_data->job_queue        = queue;
+      b_data->job_slots        = queue_length + 1;
+      b_data->sporadic         = sporadic;
+      nu_sched->budget_data    = b_data;
+      return_value  = nu_sched->pid;
+    }
+    else {
+      if (b_data != NULL) free(b_data);
+      if (queue != NULL)  free(queue);
+    }
+  }
+  return return_value;
+}
+
+
+/**
+* Adds a job to the given server's queue. The job will be run once, when the server next has budget.
+*  May be called from an ISR.
+*  Returns true on success, or false if the server doesn't exist or its queue is full.
+*/
+boolean Scheduler::submitJob(uint32_t server_pid, FunctionPointer job) {
+  boolean return_value  = false;
+  ScheduleItem *obj  = findNodeByPID(server_pid);
+  if ((job != NULL) && (obj != NULL) && (obj->budget_data != NULL) && (obj->budget_data->job_queue != NULL)) {
+    ScheduleBudget *b_data  = obj->budget_data;
+    SCHEDULER_ENTER_CRITICAL();
+    uint8_t nu_tail  = (b_data->job_tail + 1) % b_data->job_slots;
+    if (nu_tail != b_data->job_head) {
+      b_data->job_queue[b_data->job_tail] = job;
+      b_data->job_tail = nu_tail;
+      if (obj->thread_enabled && !obj->thread_fire && this->budgetReady(obj)) this->releaseSchedule(obj);
+      return_value  = true;
+    }
+    SCHEDULER_EXIT_CRITICAL();
+  }
+  return return_value;
+}
+
+
+/**
+* Returns how much CPU time (in microseconds) the given budgeted schedule has left this period.
+*  Negative if the last dispatch overran. Zero if the schedule doesn't exist or isn't budgeted.
+*/
+int32_t Scheduler::getRemainingBudget(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if ((nu_sched != NULL) && (nu_sched->budget_data != NULL)) {
+    return nu_sched->budget_data->remaining_micros;
+  }
+  return 0;
+}
+
+
+/**
+* Call this function to alter a given schedule. Set with the given period, a given number of times, with a given function call.
+*  Returns true on success or false if the given PID is not found, or there is a problem with the parameters.
+*
+* Will not set the schedule active, but will clear any pending executions for this schedule, as well as reset the timer for it.
+*/
+boolean Scheduler::alterSchedule(ScheduleItem *obj, uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback) {
   boolean return_value  = false;
   if (sch_period > 1) {
+    if (sch_callback != NULL) {
+      if ((obj != NULL) && this->admits(obj, this->executionEstimate(obj), sch_period)) {
+        this->clearRelease(obj);
+        obj->thread_recurs       = recurrence;
+        obj->thread_period       = sch_period;
+        this->setTimeToWait(obj, sch_period);
+        obj->autoclear           = ac;
+        obj->schedule_callback   = sch_callback;
+        if (obj->params != NULL) obj->params->batch_callback = NULL;   // No longer a batch schedule.
+        return_value  = true;
+      }
+    }
+  }
+  return return_value;
+}
+
+boolean Scheduler::alterSchedule(uint32_t g_pid, uint32_t sch_period, int16_t recurrence, boolean ac, FunctionPointer sch_callback) {
+  return this->alterSchedule(findNodeByPID(g_pid), sch_period, recurrence, ac, sch_callback);
+}
+
+boolean Scheduler::alterSchedule(uint32_t schedule_index, boolean ac) {
+  boolean return_value  = false;
+  ScheduleItem *nu_sched  = findNodeByPID(schedule_index);
+  if (nu_sched != NULL) {
+    nu_sched->autoclear = ac;
+    return_value  = true;
+  }
+  return return_value;
+}
+
+boolean Scheduler::alterSchedule(uint32_t schedule_index, FunctionPointer sch_callback) {
+  boolean return_value  = false;
+  if (sch_callback != NULL) {
     ScheduleItem *nu_sched  = findNodeByPID(schedule_index);
     if (nu_sched != NULL) {
-      nu_sched->thread_fire         = false;
+      nu_sched->schedule_callback   = sch_callback;
+      if (nu_sched->params != NULL) nu_sched->params->batch_callback = NULL;   // No longer a batch schedule.
+      return_value  = true;
+    }
+  }
+  return return_value;
+}
+
+boolean Scheduler::alterSchedulePeriod(uint32_t schedule_index, uint32_t sch_period) {
+  boolean return_value  = false;
+  if (sch_period > 1) {
+    ScheduleItem *nu_sched  = findNodeByPID(schedule_index);
+    if ((nu_sched != NULL) && this->admits(nu_sched, this->executionEstimate(nu_sched), sch_period)) {
+      this->clearRelease(nu_sched);
       nu_sched->thread_period       = sch_period;
-      nu_sched->thread_time_to_wait = sch_period;
+      this->setTimeToWait(nu_sched, sch_period);
       return_value  = true;
     }
   }
@@ -422,7 +1265,7 @@ boolean Scheduler::alterScheduleRecurrence(uint32_t schedule_index, int16_t recu
   boolean return_value  = false;
   ScheduleItem *nu_sched  = findNodeByPID(schedule_index);
   if (nu_sched != NULL) {
-    nu_sched->thread_fire         = false;
+    this->clearRelease(nu_sched);
     nu_sched->thread_recurs       = recurrence;
     return_value  = true;
   }
@@ -431,199 +1274,2222 @@ boolean Scheduler::alterScheduleRecurrence(uint32_t schedule_index, int16_t recu
 
 
 /**
-* Returns true if...
-* A) The schedule exists
-*    AND
-* B) The schedule is enabled, and has at least one more runtime before it *might* be auto-reaped.
+* Returns true if...
+* A) The schedule exists
+*    AND
+* B) The schedule is enabled, and has at least one more runtime before it *might* be auto-reaped.
+*/
+boolean Scheduler::willRunAgain(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    if (nu_sched->thread_enabled) {
+      if ((nu_sched->thread_recurs == -1) || (nu_sched->thread_recurs > 0)) {
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+boolean Scheduler::scheduleEnabled(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    return nu_sched->thread_enabled;
+  }
+  return false;
+}
+
+
+/**
+* Enable a previously disabled schedule.
+*  Returns true on success and false on failure.
+*/
+boolean Scheduler::enableSchedule(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    if (nu_sched->thread_mode == SCHEDULE_MODE_TIMEOUT) {
+      this->armTimeout(nu_sched, nu_sched->thread_period);
+    }
+    else {
+      this->setEnabled(nu_sched, true);
+    }
+    return true;
+  }
+  return false;
+}
+
+
+boolean Scheduler::delaySchedule(ScheduleItem *obj, uint32_t by_ms) {
+  if (obj != NULL) {
+    if (obj->thread_mode == SCHEDULE_MODE_TIMEOUT) {
+      this->armTimeout(obj, by_ms);
+    }
+    else {
+      this->setTimeToWait(obj, by_ms);
+      this->setEnabled(obj, true);
+    }
+    return true;
+  }
+  return false;
+}
+
+/**
+* Causes a given schedule's TTW (time-to-wait) to be set to the value we provide (this time only).
+* If the schedule wasn't enabled before, it will be when we return.
+*/
+boolean Scheduler::delaySchedule(uint32_t g_pid, uint32_t by_ms) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    this->delaySchedule(nu_sched, by_ms);
+    return true;
+  }
+  return false;
+}
+
+/**
+* Causes a given schedule's TTW (time-to-wait) to be reset to its period.
+* If the schedule wasn't enabled before, it will be when we return.
+*/
+boolean Scheduler::delaySchedule(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    this->delaySchedule(nu_sched, nu_sched->thread_period);
+    return true;
+  }
+  return false;
+}
+
+
+
+/****************************************************************************************************
+* Admission control. See Note 5 in the header.                                                      *
+****************************************************************************************************/
+
+// Liu & Layland's n(2^(1/n) - 1), in ppm, for n = 0..10. Beyond that we use ln(2).
+static const uint32_t RM_BOUND_PPM[11] = {1000000, 1000000, 828427, 779763, 756828, 743492, 734772, 728627, 724062, 720538, 717735};
+#define RM_BOUND_LIMIT_PPM  693147
+
+
+/**
+* Returns the optional parameters of the given schedule, allocating them if need be.
+*  Returns NULL if we couldn't malloc().
+*/
+ScheduleParams* Scheduler::getParams(ScheduleItem *obj) {
+  if (obj->params == NULL) {
+    obj->params = (ScheduleParams *) malloc(sizeof(ScheduleParams));
+    if (obj->params != NULL) {
+      memset(obj->params, 0x00, sizeof(ScheduleParams));
+      obj->params->aging_rate = SCHEDULER_DEFAULT_AGING_RATE;
+      obj->params->weight     = SCHEDULER_DEFAULT_WEIGHT;
+      obj->params->stretch_factor = 1;
+    }
+  }
+  return obj->params;
+}
+
+
+/**
+* Sets the length of a tick, in microseconds. Only used to turn periods into utilisation.
+*/
+void Scheduler::setTickPeriod(uint32_t micros) {
+  if (micros > 0) this->tick_micros = micros;
+}
+
+
+/**
+* Turns admission control on (or off, with SCHEDULER_ADMIT_NONE). Existing schedules are not
+*  re-checked, so the system may already be over the bound. getUtilisationHeadroom() will say so.
+*/
+void Scheduler::setAdmissionControl(uint8_t policy, uint32_t bound_ppm) {
+  this->admission_policy = policy;
+  this->admission_bound  = bound_ppm;
+}
+
+
+/**
+* Declares how long the given schedule's callback takes to run, in microseconds. Zero goes back to
+*  using the profiler's worst case. Returns false if the PID isn't found, or the change isn't admitted.
+*/
+boolean Scheduler::setExecutionEstimate(uint32_t g_pid, uint32_t micros) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    uint32_t effective  = micros;
+    if ((effective == 0) && (nu_sched->prof_data != NULL)) effective = nu_sched->prof_data->worst_time_micros;
+    if (this->admits(nu_sched, effective, nu_sched->thread_period)) {
+      ScheduleParams *p_data  = this->getParams(nu_sched);
+      if (p_data != NULL) {
+        p_data->exec_estimate_micros = micros;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+/**
+* Our best idea of how long the given schedule takes to run, in microseconds.
+*/
+uint32_t Scheduler::executionEstimate(ScheduleItem *obj) {
+  if (obj->budget_data != NULL) return obj->budget_data->budget_micros;
+  if ((obj->params != NULL) && (obj->params->exec_estimate_micros > 0)) return obj->params->exec_estimate_micros;
+  if ((obj->prof_data != NULL) && (obj->prof_data->sample_count > 0)) return obj->prof_data->worst_time_micros;
+  return 0;
+}
+
+
+/**
+* Utilisation (ppm) of a schedule with the given execution time and period. Saturates rather than wrap.
+*/
+uint32_t Scheduler::utilisationOf(uint32_t exec_micros, uint32_t sch_period) {
+  uint64_t ppm  = ((uint64_t) exec_micros * 1000000UL) / ((uint64_t) sch_period * this->tick_micros);
+  return (ppm > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) ppm;
+}
+
+uint32_t Scheduler::utilisationOf(ScheduleItem *obj) {
+  return this->utilisationOf(this->executionEstimate(obj), obj->thread_period);
+}
+
+
+/**
+* The utilisation bound (ppm) for the given number of schedules under the current policy.
+*/
+uint32_t Scheduler::admissionBound(uint16_t schedules) {
+  uint32_t return_value  = 1000000;
+  if (this->admission_policy == SCHEDULER_ADMIT_RM) {
+    return_value = (schedules <= 10) ? RM_BOUND_PPM[schedules] : RM_BOUND_LIMIT_PPM;
+  }
+  if ((this->admission_bound > 0) && (this->admission_bound < return_value)) {
+    return_value = this->admission_bound;
+  }
+  return return_value;
+}
+
+
+/**
+* Would the schedule set still be admissible if a schedule with the given execution time and period
+*  were added (replacing == NULL), or took the place of replacing?
+* Only schedules that add load count towards n in the bound, so zero-cost ones never tighten it.
+* Always true if admission control is off.
+*/
+boolean Scheduler::admits(ScheduleItem *replacing, uint32_t exec_micros, uint32_t sch_period) {
+  if ((this->admission_policy == SCHEDULER_ADMIT_NONE) || (sch_period == 0)) return true;
+  uint64_t total  = this->utilisationOf(exec_micros, sch_period);   // 64 bits, so the sum can't wrap.
+  uint16_t count  = (total > 0) ? 1 : 0;
+  ScheduleItem *current  = this->schedule_root_node;
+  while (current != NULL) {
+    if (current != replacing) {
+      uint32_t load  = this->utilisationOf(current);
+      total += load;
+      if (load > 0) count++;
+    }
+    current = current->next;
+  }
+  return (total <= this->admissionBound(count));
+}
+
+
+/**
+* Returns the total utilisation of every schedule, in ppm. Saturates at 0xFFFFFFFF. See Note 5.
+*/
+uint32_t Scheduler::getUtilisation() {
+  uint64_t total  = 0;
+  ScheduleItem *current  = this->schedule_root_node;
+  while (current != NULL) {
+    total += this->utilisationOf(current);
+    current = current->next;
+  }
+  return (total > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) total;
+}
+
+
+/**
+* Returns how much more utilisation (in ppm) could be admitted. Negative if we are already over.
+*/
+int32_t Scheduler::getUtilisationHeadroom() {
+  uint16_t count  = 0;
+  ScheduleItem *current  = this->schedule_root_node;
+  while (current != NULL) {
+    if (this->utilisationOf(current) > 0) count++;     // As admits() counts them.
+    current = current->next;
+  }
+  int64_t headroom  = (int64_t) this->admissionBound(count) - (int64_t) this->getUtilisation();
+  return (headroom < -0x7FFFFFFF) ? -0x7FFFFFFF : (int32_t) headroom;
+}
+
+
+
+/****************************************************************************************************
+* Running-job watchdog.                                                                             *
+****************************************************************************************************/
+
+/**
+* Gives the given schedule a budget (in ticks) for any single run. If a run takes longer, the next
+*  advanceScheduler() records an overrun and calls the overrun hook. Zero turns the watchdog off.
+* Returns false if the PID isn't found.
+*/
+boolean Scheduler::setWatchdog(uint32_t g_pid, uint32_t ticks) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    if ((ticks == 0) && (nu_sched->params == NULL)) return true;
+    ScheduleParams *p_data  = this->getParams(nu_sched);
+    if (p_data != NULL) {
+      p_data->watchdog_ticks = ticks;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void Scheduler::setOverrunHook(OverrunHook hook) {
+  this->overrun_hook = hook;
+}
+
+
+uint32_t Scheduler::getOverrunCount() {
+  return this->overrun_count;
+}
+
+
+/**
+* Copies up to max_events of the most recent overruns into out, oldest first.
+*  Returns the number copied.
+*/
+uint8_t Scheduler::getOverrunEvents(ScheduleOverrun* out, uint8_t max_events) {
+  uint8_t available  = (this->overrun_count < SCHEDULER_OVERRUN_LOG) ? this->overrun_count : SCHEDULER_OVERRUN_LOG;
+  uint8_t count      = (available < max_events) ? available : max_events;
+  SCHEDULER_ENTER_CRITICAL();
+  for (uint8_t i = 0; i < count; i++) {
+    out[i] = this->overrun_log[(this->overrun_next + SCHEDULER_OVERRUN_LOG - count + i) % SCHEDULER_OVERRUN_LOG];
+  }
+  SCHEDULER_EXIT_CRITICAL();
+  return count;
+}
+
+
+/**
+* Called just before a schedule is dispatched. Work out when it will have overrun, so that the ISR
+*  only has a comparison to make.
+*/
+void Scheduler::startWatchdog(ScheduleItem *obj) {
+  if ((obj->params != NULL) && (obj->params->watchdog_ticks > 0)) {
+    SCHEDULER_ENTER_CRITICAL();
+    this->watchdog_started  = this->elapsed_ticks;
+    this->watchdog_deadline = this->elapsed_ticks + obj->params->watchdog_ticks;
+    this->watchdog_open     = -1;
+    this->watchdog_armed    = true;
+    SCHEDULER_EXIT_CRITICAL();
+  }
+}
+
+
+/**
+* Called just after a schedule returns. If it overran, fill in how long it actually took.
+*/
+void Scheduler::stopWatchdog() {
+  if (!this->watchdog_armed && (this->watchdog_open < 0)) return;
+  SCHEDULER_ENTER_CRITICAL();
+  if (this->watchdog_open >= 0) {
+    this->overrun_log[this->watchdog_open].ticks = this->elapsed_ticks - this->watchdog_started;
+    this->watchdog_open = -1;
+  }
+  this->watchdog_armed = false;
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Called from advanceScheduler(). Costs a couple of loads unless the running schedule has overrun.
+*/
+void Scheduler::checkWatchdog() {
+  if (this->watchdog_armed && ((int32_t) (this->elapsed_ticks - this->watchdog_deadline) >= 0)) {
+    this->watchdog_armed = false;   // Only report each run once.
+    ScheduleOverrun *event  = &this->overrun_log[this->overrun_next];
+    event->pid         = this->currently_executing;
+    event->ticks       = this->elapsed_ticks - this->watchdog_started;
+    event->detected_at = this->elapsed_ticks;
+    this->watchdog_open = this->overrun_next;
+    this->overrun_next  = (this->overrun_next + 1) % SCHEDULER_OVERRUN_LOG;
+    this->overrun_count++;
+    if (this->overrun_hook != NULL) this->overrun_hook(event->pid, event->ticks);
+  }
+}
+
+
+
+/****************************************************************************************************
+* Timeout schedules and the timing wheel. See Note 3 in the header.                                 *
+****************************************************************************************************/
+
+/**
+* (Re)arms a timeout schedule to fire by_ms ticks from now, and enables it.
+* If the item is armed and the deadline moves later, only the deadline is rewritten. The entry stays
+*  in its old slot (which comes up first), and advanceTimeoutWheel() will move it along then. A deadline
+*  that moves earlier may fall before the old slot comes up, so the entry is moved straight away.
+*/
+void Scheduler::armTimeout(ScheduleItem *obj, uint32_t by_ms) {
+  if (by_ms == 0) by_ms = 1;       // This tick's slot has already been visited. Fire on the next one.
+  boolean was_armed  = obj->thread_enabled && obj->in_wheel;
+  this->setEnabled(obj, true);
+  SCHEDULER_ENTER_CRITICAL();
+  uint32_t nu_deadline  = this->scheduleClock() + by_ms;
+  if (obj->in_wheel && !(was_armed && ((int32_t) (nu_deadline - obj->thread_deadline) >= 0))) {
+    this->unlinkFromWheel(obj);
+  }
+  obj->thread_deadline = nu_deadline;
+  if (!obj->in_wheel) {
+    this->linkIntoWheel(obj, obj->thread_deadline & (SCHEDULER_WHEEL_SLOTS - 1));
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Pushes the given item onto the front of a wheel slot. Caller must hold the critical section.
+*/
+void Scheduler::linkIntoWheel(ScheduleItem *obj, uint8_t slot) {
+  obj->wheel_prev = NULL;
+  obj->wheel_next = this->timeout_wheel[slot];
+  if (obj->wheel_next != NULL) obj->wheel_next->wheel_prev = obj;
+  this->timeout_wheel[slot] = obj;
+  obj->wheel_slot = slot;
+  obj->in_wheel   = true;
+}
+
+
+/**
+* Takes the given item out of the wheel. Caller must hold the critical section.
+*/
+void Scheduler::unlinkFromWheel(ScheduleItem *obj) {
+  if (obj->wheel_prev != NULL) obj->wheel_prev->wheel_next = obj->wheel_next;
+  else this->timeout_wheel[obj->wheel_slot] = obj->wheel_next;
+  if (obj->wheel_next != NULL) obj->wheel_next->wheel_prev = obj->wheel_prev;
+  obj->wheel_next = NULL;
+  obj->wheel_prev = NULL;
+  obj->in_wheel   = false;
+}
+
+
+/**
+* Visits the wheel slot for the current tick. Entries that are due are fired. Entries that were
+*  disabled since they were linked in are stale, and are dropped. Entries that were re-armed are
+*  moved to the slot of their new deadline (or left alone, if that is this slot on a later lap).
+* Called from advanceScheduler(), so we are already in the ISR.
+*/
+void Scheduler::advanceTimeoutWheel() {
+  uint32_t now  = this->scheduleClock();
+  uint8_t slot  = now & (SCHEDULER_WHEEL_SLOTS - 1);
+  ScheduleItem *current  = this->timeout_wheel[slot];
+  ScheduleItem *temp;
+  while (current != NULL) {
+    temp = current->wheel_next;
+    if (!current->thread_enabled) {
+      this->unlinkFromWheel(current);
+    }
+    else if ((int32_t) (current->thread_deadline - now) <= 0) {
+      this->unlinkFromWheel(current);
+      this->releaseSchedule(current);
+    }
+    else if ((current->thread_deadline & (SCHEDULER_WHEEL_SLOTS - 1)) != slot) {
+      this->unlinkFromWheel(current);
+      this->linkIntoWheel(current, current->thread_deadline & (SCHEDULER_WHEEL_SLOTS - 1));
+    }
+    current = temp;
+  }
+}
+
+
+/**
+* How many ticks until the given schedule fires? Only meaningful for enabled schedules.
+*/
+uint32_t Scheduler::timeToWait(ScheduleItem *obj) {
+  if (obj->thread_mode == SCHEDULE_MODE_TIMEOUT) {
+    if (obj->thread_enabled && obj->in_wheel) {
+      int32_t remaining  = (int32_t) (obj->thread_deadline - this->scheduleClock());
+      return (remaining > 0) ? (uint32_t) remaining : 0;
+    }
+    return obj->thread_period;
+  }
+  if (this->hasDeadline(obj) && obj->thread_enabled) {
+    int32_t remaining  = (int32_t) (obj->thread_deadline - this->scheduleClock()) - 1;  // See setTimeToWait().
+    return (remaining > 0) ? (uint32_t) remaining : 0;
+  }
+  return obj->thread_time_to_wait;
+}
+
+
+
+/****************************************************************************************************
+* Triggered schedules. See Note 18 in the header.                                                   *
+****************************************************************************************************/
+
+/**
+*  Creates a schedule that runs only when triggerSchedule() is called, subject to the given trigger mode.
+*    It stays (enabled) until removed.
+*
+*  Returns the newly-created PID on success, or 0 on failure.
+*/
+uint32_t Scheduler::createTriggeredSchedule(uint8_t mode, uint32_t window, uint8_t burst, FunctionPointer sch_callback) {
+  uint32_t return_value  = 0;
+  uint32_t period        = (window > 1) ? window : 2;   // Only shown in dumps. newScheduleItem() needs one.
+  if ((sch_callback != NULL) && this->admits(NULL, 0, period)) {
+    ScheduleItem *nu_sched = this->newScheduleItem(period, -1, false, sch_callback);
+    if (nu_sched != NULL) {
+      nu_sched->thread_mode = SCHEDULE_MODE_TIMEOUT;   // Out of the tick list. Not armed until triggered.
+      this->setEnabled(nu_sched, true);
+      if (this->setTriggerMode(nu_sched->pid, mode, window, burst)) {
+        return_value  = nu_sched->pid;
+      }
+      else {
+        this->destroyScheduleItem(nu_sched);
+      }
+    }
+  }
+  return return_value;
+}
+
+
+/**
+* Sets how triggers of the given schedule are handled. A token bucket starts full.
+*  Returns false if the schedule wasn't found, the mode is unknown, or there wasn't memory.
+*/
+boolean Scheduler::setTriggerMode(uint32_t g_pid, uint8_t mode, uint32_t window, uint8_t burst) {
+  ScheduleItem *obj  = findNodeByPID(g_pid);
+  if ((obj == NULL) || (mode > SCHEDULER_TRIGGER_BUCKET)) return false;
+  if ((mode != SCHEDULER_TRIGGER_IMMEDIATE) && (window == 0)) return false;
+  if ((mode == SCHEDULER_TRIGGER_BUCKET) && (burst == 0)) return false;
+  ScheduleParams *params  = this->getParams(obj);
+  if (params == NULL) return false;
+  SCHEDULER_ENTER_CRITICAL();
+  params->trigger_mode   = mode;
+  params->trigger_window = window;
+  params->trigger_burst  = burst;
+  params->trigger_tokens = burst;
+  params->trigger_mark   = this->elapsed_ticks - window;   // As if the window had just passed.
+  SCHEDULER_EXIT_CRITICAL();
+  return true;
+}
+
+
+/**
+* Triggers the given schedule, as its trigger mode allows. O(1) after the PID lookup, and allocates nothing.
+*  Returns false if the trigger was dropped, or the schedule is disabled or wasn't found.
+*/
+boolean Scheduler::triggerSchedule(uint32_t g_pid) {
+  ScheduleItem *obj  = findNodeByPID(g_pid);
+  if ((obj == NULL) || !obj->thread_enabled) return false;
+  ScheduleParams *params  = obj->params;
+  uint8_t mode  = (params != NULL) ? params->trigger_mode : SCHEDULER_TRIGGER_IMMEDIATE;
+  boolean return_value  = true;
+  SCHEDULER_ENTER_CRITICAL();
+  if (!obj->thread_fire) {     // A trigger that arrives while it is already due is absorbed into that run.
+    uint32_t now  = this->elapsed_ticks;
+    if (mode == SCHEDULER_TRIGGER_DEBOUNCE) {
+      this->delaySchedule(obj, params->trigger_window);   // Pushes the release back every time.
+    }
+    else {
+      if (mode == SCHEDULER_TRIGGER_THROTTLE) {
+        if ((now - params->trigger_mark) >= params->trigger_window) params->trigger_mark = now;
+        else return_value = false;
+      }
+      else if (mode == SCHEDULER_TRIGGER_BUCKET) {
+        uint32_t refills  = (now - params->trigger_mark) / params->trigger_window;
+        if (refills >= (uint32_t) (params->trigger_burst - params->trigger_tokens)) {
+          params->trigger_tokens = params->trigger_burst;
+          params->trigger_mark   = now;
+        }
+        else if (refills > 0) {
+          params->trigger_tokens += refills;
+          params->trigger_mark   += refills * params->trigger_window;
+        }
+        if (params->trigger_tokens > 0) params->trigger_tokens--;
+        else return_value = false;
+      }
+      if (return_value) this->releaseSchedule(obj);
+      else params->trigger_drops++;
+    }
+  }
+  SCHEDULER_EXIT_CRITICAL();
+  return return_value;
+}
+
+
+/**
+* How many triggers of the given schedule have been dropped by its throttle or token bucket?
+*/
+uint32_t Scheduler::getTriggerDrops(uint32_t g_pid) {
+  ScheduleItem *obj  = findNodeByPID(g_pid);
+  return ((obj != NULL) && (obj->params != NULL)) ? obj->params->trigger_drops : 0;
+}
+
+
+
+/****************************************************************************************************
+* Software PWM engine. See Note 19 in the header.                                                   *
+****************************************************************************************************/
+
+/**
+* Starts the PWM engine with every channel off. Restarting it turns every channel off again.
+*/
+boolean Scheduler::beginPwm(uint8_t bits, PwmOutput output) {
+  if ((bits < 1) || (bits > SCHEDULER_PWM_MAX_BITS)) return false;
+  PwmEngine *engine  = (PwmEngine *) malloc(sizeof(PwmEngine));
+  if (engine == NULL) return false;
+  memset(engine, 0x00, sizeof(PwmEngine));
+  engine->bits   = bits;
+  engine->output = output;
+  this->stopPwm();
+  SCHEDULER_ENTER_CRITICAL();
+  this->pwm = engine;
+  SCHEDULER_EXIT_CRITICAL();
+  return true;
+}
+
+
+/**
+* Stops the PWM engine. The output hook is not called again, so it is up to the caller to leave the
+*  pins in a sensible state.
+*/
+void Scheduler::stopPwm() {
+  if (this->pwm != NULL) {
+    SCHEDULER_ENTER_CRITICAL();
+    PwmEngine *engine  = this->pwm;
+    this->pwm = NULL;
+    SCHEDULER_EXIT_CRITICAL();
+    free(engine);
+  }
+}
+
+
+/**
+* Sets a channel's duty cycle, out of 2^bits. It takes effect when the next period starts.
+*  Returns false if the engine isn't running or the channel is out of range.
+*/
+boolean Scheduler::setPwmDuty(uint8_t channel, uint16_t duty) {
+  if ((this->pwm == NULL) || (channel > 31)) return false;
+  PwmEngine *engine  = this->pwm;
+  uint32_t bit       = (1UL << channel);
+  boolean  full      = ((uint32_t) duty >= (1UL << engine->bits));
+  SCHEDULER_ENTER_CRITICAL();
+  if (!engine->dirty) {   // Start from what is in force.
+    memcpy(engine->pending, engine->planes, sizeof(engine->planes));
+    engine->pending_full = engine->full;
+  }
+  for (uint8_t b = 0; b < engine->bits; b++) {
+    if (!full && ((duty >> b) & 1)) engine->pending[b] |= bit;
+    else engine->pending[b] &= ~bit;
+  }
+  if (full) engine->pending_full |= bit;
+  else engine->pending_full &= ~bit;
+  engine->dirty     = true;
+  SCHEDULER_EXIT_CRITICAL();
+  return true;
+}
+
+
+/**
+* The current outputs, one bit per channel.
+*/
+uint32_t Scheduler::getPwmMask() {
+  return (this->pwm != NULL) ? this->pwm->mask : 0;
+}
+
+
+/**
+* Called from advanceScheduler(). Turns on every channel with a non-zero duty when a period starts, and
+*  from then on turns off every channel whose duty equals the phase, all channels at once.
+*/
+void Scheduler::advancePwm() {
+  PwmEngine *engine  = this->pwm;
+  uint32_t   mask    = engine->mask;
+  if (engine->phase == 0) {
+    if (engine->dirty) {
+      memcpy(engine->planes, engine->pending, sizeof(engine->planes));
+      engine->full  = engine->pending_full;
+      engine->dirty = false;
+    }
+    mask = engine->full;
+    for (uint8_t b = 0; b < engine->bits; b++) mask |= engine->planes[b];
+  }
+  else {
+    uint32_t match  = ~engine->full;      // Channels whose duty equals the phase.
+    for (uint8_t b = 0; b < engine->bits; b++) {
+      match &= ((engine->phase >> b) & 1) ? engine->planes[b] : ~engine->planes[b];
+    }
+    mask &= ~match;
+  }
+  engine->phase = (engine->phase + 1) & ((1UL << engine->bits) - 1);
+  if (mask != engine->mask) {
+    engine->mask = mask;
+    if (engine->output != NULL) engine->output(mask);
+  }
+}
+
+
+
+/****************************************************************************************************
+* Budgeted schedules. See Note 4 in the header.                                                     *
+****************************************************************************************************/
+
+/**
+* Called on every tick for an enabled budgeted schedule. Drives the child, tops up the budget
+*  when the period rolls over, and decides whether the schedule should be dispatched.
+*/
+void Scheduler::advanceBudget(ScheduleItem *obj) {
+  ScheduleBudget *b_data  = obj->budget_data;
+  if (b_data->child != NULL) b_data->child->advanceScheduler();
+  if (b_data->sporadic) this->refillSporadic(obj);
+  else if (obj->thread_time_to_wait > 0) obj->thread_time_to_wait--;
+  else {
+    obj->thread_time_to_wait = obj->thread_period;
+    if (b_data->remaining_micros < 0) {
+      b_data->remaining_micros += (int32_t) b_data->budget_micros;   // Pay off any debt first.
+    }
+    else {
+      b_data->remaining_micros  = (int32_t) b_data->budget_micros;
+    }
+  }
+  if (!obj->thread_fire && this->budgetReady(obj)) this->releaseSchedule(obj);
+}
+
+
+/**
+* Runs one unit of work on behalf of a budgeted schedule, and charges the time taken to its budget.
+*/
+void Scheduler::dispatchBudgeted(ScheduleItem *obj) {
+  ScheduleBudget *b_data  = obj->budget_data;
+  uint32_t start_time = micros();
+  if (b_data->child != NULL) {
+    b_data->child->serviceScheduledEvents();
+  }
+  else if (b_data->job_head != b_data->job_tail) {
+    FunctionPointer job  = b_data->job_queue[b_data->job_head];
+    b_data->job_head = (b_data->job_head + 1) % b_data->job_slots;
+    ((void (*)(void)) job)();
+  }
+  int32_t used  = (int32_t) (micros() - start_time);
+  SCHEDULER_ENTER_CRITICAL();
+  b_data->remaining_micros -= used;
+  if (b_data->remaining_micros <= 0) b_data->exhausted_count++;
+  if (b_data->sporadic) {
+    // Schedule the return of what we just spent, one period from now. If we are out of slots,
+    //  fold it into the newest one. That gives it back a little late, which is the safe direction.
+    if (b_data->refill_count < SCHEDULER_SPORADIC_REFILLS) {
+      uint8_t slot  = (b_data->refill_head + b_data->refill_count) % SCHEDULER_SPORADIC_REFILLS;
+      b_data->refill_tick[slot]   = this->elapsed_ticks + obj->thread_period;
+      b_data->refill_micros[slot] = used;
+      b_data->refill_count++;
+    }
+    else {
+      uint8_t slot  = (b_data->refill_head + b_data->refill_count - 1) % SCHEDULER_SPORADIC_REFILLS;
+      b_data->refill_tick[slot]    = this->elapsed_ticks + obj->thread_period;
+      b_data->refill_micros[slot] += used;
+    }
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Hands back any budget that a sporadic server spent one period ago.
+*/
+void Scheduler::refillSporadic(ScheduleItem *obj) {
+  ScheduleBudget *b_data  = obj->budget_data;
+  while ((b_data->refill_count > 0) && ((int32_t) (this->elapsed_ticks - b_data->refill_tick[b_data->refill_head]) >= 0)) {
+    b_data->remaining_micros += b_data->refill_micros[b_data->refill_head];
+    b_data->refill_head = (b_data->refill_head + 1) % SCHEDULER_SPORADIC_REFILLS;
+    b_data->refill_count--;
+  }
+}
+
+
+/**
+* A budgeted schedule is ready if it has budget left, and something to spend it on.
+*/
+boolean Scheduler::budgetReady(ScheduleItem *obj) {
+  ScheduleBudget *b_data  = obj->budget_data;
+  if (b_data->remaining_micros > 0) {
+    if (b_data->child != NULL) {
+      return (b_data->child->getPendingSchedules() > 0);
+    }
+    return (b_data->job_head != b_data->job_tail);
+  }
+  return false;
+}
+
+
+/**
+* Destroys whatever budget data (and job queue) might be stored in the given schedule.
+*/
+void Scheduler::clearBudgetData(ScheduleItem *obj) {
+  if ((obj != NULL) && (obj->budget_data != NULL)) {
+    if (obj->budget_data->job_queue != NULL) free(obj->budget_data->job_queue);
+    free(obj->budget_data);
+    obj->budget_data = NULL;
+  }
+}
+
+
+
+/**
+* Marks the given schedule as due. If it was already due, the release is coalesced with the pending
+*  one, and the original release time is kept.
+*/
+void Scheduler::releaseSchedule(ScheduleItem *obj) {
+  if (!obj->thread_fire) {
+    obj->release_tick = this->elapsed_ticks;
+    obj->thread_fire  = true;
+    this->released_total++;
+    if ((this->ready_heap.items != NULL) && (obj->ready_pos == 0)) this->readyPush(obj);
+    if ((this->shed_heap.items != NULL) && (obj->shed_pos == 0) && (obj->params != NULL) && (obj->params->utility > 0)) this->shedPush(obj);
+  }
+}
+
+
+/**
+* Marks the given schedule as no longer due (because it ran, or its release was dropped or cancelled),
+*  and takes the release out of the shed queue, so that its cost stops counting against the backlog.
+*  Main loop only.
+*/
+void Scheduler::clearRelease(ScheduleItem *obj) {
+  SCHEDULER_ENTER_CRITICAL();     // Before the ISR can release it again, and queue the new release.
+  this->shedRemove(obj);
+  if (obj->thread_fire) {
+    obj->thread_fire = false;
+    this->cleared_total++;
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Enables or disables the given schedule, keeping the active count and the tick list up to date. Enabled
+*  periodic and budgeted schedules are linked into the tick list, so advanceScheduler() never has to look
+*  at disabled ones (or at timeouts, which have the wheel). Also call after changing a schedule's mode.
+*/
+void Scheduler::setEnabled(ScheduleItem *obj, boolean enabled) {
+  boolean ticks = enabled && ((obj->budget_data != NULL) || (obj->thread_mode == SCHEDULE_MODE_PERIODIC));
+  SCHEDULER_ENTER_CRITICAL();
+  if (enabled != obj->thread_enabled) {
+    if (this->hasDeadline(obj)) {   // The countdown stands still while disabled.
+      if (enabled) obj->thread_deadline = this->scheduleClock() + obj->thread_time_to_wait + 1;
+      else obj->thread_time_to_wait = this->timeToWait(obj);
+    }
+    if (enabled) this->active_count++;
+    else this->active_count--;
+    obj->thread_enabled = enabled;
+  }
+  if (ticks && !obj->in_tick_list) {
+    obj->tick_prev = NULL;
+    obj->tick_next = this->tick_head;
+    if (this->tick_head != NULL) this->tick_head->tick_prev = obj;
+    this->tick_head    = obj;
+    obj->in_tick_list  = true;
+  }
+  else if (!ticks && obj->in_tick_list) {
+    if (obj->tick_prev != NULL) obj->tick_prev->tick_next = obj->tick_next;
+    else this->tick_head = obj->tick_next;
+    if (obj->tick_next != NULL) obj->tick_next->tick_prev = obj->tick_prev;
+    obj->tick_next    = NULL;
+    obj->tick_prev    = NULL;
+    obj->in_tick_list = false;
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Call this function to push the schedules forward.
+*/
+void Scheduler::advanceScheduler() {
+  this->elapsed_ticks++;
+  this->checkWatchdog();
+  if (this->pwm != NULL) this->advancePwm();
+  if (this->paused) {
+    this->epoch_offset++;          // The schedule clock stands still. See Note 21.
+    return;
+  }
+  if (this->cyclic_jobs != NULL) {
+    if (++this->cyclic_tick >= this->cyclic_minor) {   // Table-driven. See Note 12.
+      this->cyclic_tick       = 0;
+      this->cyclic_frame_tick = this->elapsed_ticks;
+      this->cyclic_frame_count++;
+    }
+    return;
+  }
+  this->advanceTimeoutWheel();
+  uint32_t now  = this->scheduleClock();
+  ScheduleItem *current  = this->tick_head;       // Only enabled periodic and budgeted schedules.
+  while (current != NULL) {
+    if (current->budget_data != NULL) {
+      this->advanceBudget(current);
+    }
+    else if (this->absolute_deadlines) {
+      if ((int32_t) (now - current->thread_deadline) >= 0) {
+        if (!this->suspended(current)) this->releaseSchedule(current);
+        current->thread_deadline += this->periodOf(current) + 1;   // Same cadence as the countdown.
+        if ((int32_t) (current->thread_deadline - now) <= 0) current->thread_deadline = now + this->periodOf(current) + 1;  // Fell behind. Don't catch up.
+      }
+    }
+    else {
+      if (current->thread_time_to_wait > 0) current->thread_time_to_wait--;
+      else {
+        if (!this->suspended(current)) this->releaseSchedule(current);
+        current->thread_time_to_wait = this->periodOf(current);
+      }
+    }
+    current = current->tick_next;
+  }
+  if ((this->crit_mode > 0) && (this->crit_recovery_ticks > 0) && ((this->elapsed_ticks - this->crit_last_trigger) >= this->crit_recovery_ticks)) {
+    this->crit_mode--;                                 // Quiet for long enough. Step down one level.
+    this->crit_last_trigger = this->elapsed_ticks;
+    this->crit_switch_count++;
+  }
+}
+
+
+/**
+* Call to disable a given schedule.
+*  Will reset the time_to_wait so that if the schedule is re-enabled, it doesn't fire sooner than expected.
+*  Returns true on success and false on failure.
+*/
+boolean Scheduler::disableSchedule(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+      this->setEnabled(nu_sched, false);
+      this->clearRelease(nu_sched);
+      this->setTimeToWait(nu_sched, nu_sched->thread_period);
+      return true;
+  }
+  return false;
+}
+
+
+/**
+* Will remove the indicated schedule and wipe its profiling data.
+* In case this gets called from the schedule's service function (IE,
+*   if the schedule tries to delete itself), let it expire this run
+*   rather than ripping the rug out from under ourselves.
+* Returns true on success and false on failure.
+*/
+boolean Scheduler::removeSchedule(uint32_t g_pid) {
+  ScheduleItem *obj  = findNodeByPID(g_pid);
+  if (obj != NULL) {
+    boolean running = (obj->pid == this->currently_executing);
+    for (uint16_t i = 0; i < this->running_batch_count; i++) {
+      if (this->running_batch[i] == obj) running = true;     // Reaped when its batch finishes.
+    }
+    if (!running) {
+      this->destroyScheduleItem(obj);
+    }
+    else { 
+      obj->autoclear = true;
+      obj->thread_recurs = 0;
+    }
+  }
+  return true;
+}
+
+
+/**
+* Runs the given schedule's callback (or gives its child or server a turn), with the bookkeeping that
+*  goes around it. This is exactly the span that the profiler times.
+*/
+void Scheduler::runSchedule(ScheduleItem *obj, void** contexts, uint16_t count) {
+  this->currently_executing = obj->pid;
+  this->startWatchdog(obj);
+  if (obj->budget_data != NULL) {
+    this->dispatchBudgeted(obj);                    // Give the child a turn.
+  }
+  else if ((obj->params != NULL) && (obj->params->batch_callback != NULL)) {
+    obj->params->batch_callback(contexts, count);   // Call the shared service function for the whole batch.
+  }
+  else {
+    ((void (*)(void)) obj->schedule_callback)();    // Call the schedule's service function.
+  }
+  this->stopWatchdog();
+  this->currently_executing = 0;
+}
+
+
+/****************************************************************************************************
+* Heaps of schedules. Used by the fair-share policy and the load shedder.                           *
+****************************************************************************************************/
+
+/**
+* Makes sure the heap can hold min_size entries. The ISR may be pushing into it, so the switch
+*  to the new array is done with interrupts off. Returns false if we couldn't get the memory.
+*/
+boolean Scheduler::heapGrow(ScheduleHeap *heap, uint16_t min_size) {
+  if ((heap->items != NULL) && (min_size <= heap->size)) return true;
+  uint16_t nu_size = (heap->size == 0) ? SCHEDULER_PID_BUCKETS : heap->size;
+  while (nu_size < min_size) {
+    if ((uint16_t) (nu_size << 1) <= nu_size) return false;
+    nu_size = nu_size << 1;
+  }
+  ScheduleItem **nu_items = (ScheduleItem **) malloc(sizeof(ScheduleItem*) * nu_size);
+  if (nu_items == NULL) return false;
+  SCHEDULER_ENTER_CRITICAL();
+  ScheduleItem **old_items = heap->items;
+  if (old_items != NULL) memcpy(nu_items, old_items, sizeof(ScheduleItem*) * heap->count);
+  heap->items = nu_items;
+  heap->size  = nu_size;
+  SCHEDULER_EXIT_CRITICAL();
+  if (old_items != NULL) free(old_items);
+  return true;
+}
+
+
+/**
+* Empties the heap and gives back its memory.
+*/
+void Scheduler::heapFree(ScheduleHeap *heap) {
+  SCHEDULER_ENTER_CRITICAL();
+  ScheduleItem **old_items = heap->items;
+  for (uint16_t i = 0; i < heap->count; i++) *this->heapPos(heap, old_items[i]) = 0;
+  heap->items = NULL;
+  heap->count = 0;
+  heap->size  = 0;
+  SCHEDULER_EXIT_CRITICAL();
+  if (old_items != NULL) free(old_items);
+}
+
+
+/**
+* Each schedule keeps its (1-based) position in each heap it might be in, so it can be removed from the middle.
+*/
+uint16_t* Scheduler::heapPos(ScheduleHeap *heap, ScheduleItem *obj) {
+  return (heap->order == SCHEDULER_HEAP_VRUNTIME) ? &obj->ready_pos : &obj->shed_pos;
+}
+
+
+/**
+* Should a come out of the heap before b?
+*  SCHEDULER_HEAP_VRUNTIME: smaller virtual runtime first (allowing for wrap), then lower PID.
+*  SCHEDULER_HEAP_DENSITY:  less utility per microsecond first, then higher (newer) PID.
+*/
+boolean Scheduler::heapBefore(ScheduleHeap *heap, ScheduleItem *a, ScheduleItem *b) {
+  if (heap->order == SCHEDULER_HEAP_VRUNTIME) {
+    int32_t diff = (int32_t) (a->vruntime - b->vruntime);
+    return (diff != 0) ? (diff < 0) : (a->pid < b->pid);
+  }
+  uint64_t a_value = (uint64_t) a->params->utility * b->params->shed_cost;   // Cross-multiplied, so no division.
+  uint64_t b_value = (uint64_t) b->params->utility * a->params->shed_cost;
+  return (a_value != b_value) ? (a_value < b_value) : (a->pid > b->pid);
+}
+
+
+/**
+* Adds a schedule to the heap. Called with interrupts off (or from the ISR).
+*/
+void Scheduler::heapPush(ScheduleHeap *heap, ScheduleItem *obj) {
+  if (heap->count >= heap->size) return;   // Can't happen: the heap is as big as the list.
+  heap->items[heap->count] = obj;
+  *this->heapPos(heap, obj) = ++heap->count;
+  this->heapSiftUp(heap, heap->count - 1);
+}
+
+
+/**
+* Takes the given schedule out of the heap, wherever it is. Called with interrupts off.
+*/
+void Scheduler::heapRemove(ScheduleHeap *heap, ScheduleItem *obj) {
+  uint16_t *pos = this->heapPos(heap, obj);
+  if (*pos == 0) return;
+  uint16_t idx  = *pos - 1;
+  *pos = 0;
+  heap->count--;
+  if (idx < heap->count) {
+    heap->items[idx] = heap->items[heap->count];
+    *this->heapPos(heap, heap->items[idx]) = idx + 1;
+    this->heapSiftUp(heap, idx);
+    this->heapSiftDown(heap, *this->heapPos(heap, heap->items[idx]) - 1);
+  }
+}
+
+
+void Scheduler::heapSiftUp(ScheduleHeap *heap, uint16_t idx) {
+  ScheduleItem *obj = heap->items[idx];
+  while (idx > 0) {
+    uint16_t parent = (idx - 1) >> 1;
+    if (!this->heapBefore(heap, obj, heap->items[parent])) break;
+    heap->items[idx] = heap->items[parent];
+    *this->heapPos(heap, heap->items[idx]) = idx + 1;
+    idx = parent;
+  }
+  heap->items[idx] = obj;
+  *this->heapPos(heap, obj) = idx + 1;
+}
+
+
+void Scheduler::heapSiftDown(ScheduleHeap *heap, uint16_t idx) {
+  ScheduleItem *obj = heap->items[idx];
+  while (true) {
+    uint16_t child = (idx << 1) + 1;
+    if (child >= heap->count) break;
+    if ((child + 1 < heap->count) && this->heapBefore(heap, heap->items[child + 1], heap->items[child])) child++;
+    if (!this->heapBefore(heap, heap->items[child], obj)) break;
+    heap->items[idx] = heap->items[child];
+    *this->heapPos(heap, heap->items[idx]) = idx + 1;
+    idx = child;
+  }
+  heap->items[idx] = obj;
+  *this->heapPos(heap, obj) = idx + 1;
+}
+
+
+/****************************************************************************************************
+* Dispatch policy. See Note 8 in the header.                                                        *
+****************************************************************************************************/
+
+/**
+* Chooses how serviceScheduledEvents() picks between due schedules. Choosing fair share sets up the ready
+*  heap with whatever is already due, gives every schedule somewhere to keep its achieved share, and
+*  starts the achieved-share figures over.
+*/
+boolean Scheduler::setDispatchPolicy(uint8_t policy) {
+  if (policy == SCHEDULER_POLICY_FAIR_SHARE) {
+    ScheduleItem *current = this->schedule_root_node;
+    while (current != NULL) {
+      if (this->getParams(current) == NULL) return false;
+      current = current->next;
+    }
+    if (!this->heapGrow(&this->ready_heap, this->schedule_count)) return false;   // Last, so no heap is left behind.
+    SCHEDULER_ENTER_CRITICAL();
+    this->fair_total_micros = 0;
+    current = this->schedule_root_node;
+    while (current != NULL) {
+      if (current->params != NULL) current->params->fair_micros = 0;
+      if (current->thread_fire && (current->ready_pos == 0)) this->readyPush(current);
+      current = current->next;
+    }
+    this->dispatch_policy = policy;
+    SCHEDULER_EXIT_CRITICAL();
+  }
+  else {
+    this->dispatch_policy = policy;
+    this->heapFree(&this->ready_heap);
+  }
+  return true;
+}
+
+
+/**
+* Sets the base priority and aging rate that the given schedule competes with under SCHEDULER_POLICY_AGING.
+*/
+boolean Scheduler::setSchedulePriority(uint32_t g_pid, uint16_t priority, uint16_t aging_rate) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    ScheduleParams *p_data  = this->getParams(nu_sched);
+    if (p_data != NULL) {
+      p_data->priority   = priority;
+      p_data->aging_rate = aging_rate;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* Sets the given schedule's share of the CPU under SCHEDULER_POLICY_FAIR_SHARE, relative to the others.
+*/
+boolean Scheduler::setScheduleWeight(uint32_t g_pid, uint16_t weight) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if ((nu_sched != NULL) && (weight > 0)) {
+    ScheduleParams *p_data  = this->getParams(nu_sched);
+    if (p_data != NULL) {
+      p_data->weight = weight;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* Reports the share of the CPU the given schedule is configured for, and the share it has actually had.
+*/
+boolean Scheduler::getFairShare(uint32_t g_pid, uint32_t* configured_ppm, uint32_t* achieved_ppm) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched == NULL) return false;
+  uint64_t total_weight = 0;
+  ScheduleItem *current = this->schedule_root_node;
+  while (current != NULL) {
+    if (current->thread_enabled) total_weight += (current->params != NULL) ? current->params->weight : SCHEDULER_DEFAULT_WEIGHT;
+    current = current->next;
+  }
+  uint32_t weight = (nu_sched->params != NULL) ? nu_sched->params->weight : SCHEDULER_DEFAULT_WEIGHT;
+  if (configured_ppm != NULL) {
+    *configured_ppm = (nu_sched->thread_enabled && (total_weight > 0)) ? (uint32_t) ((weight * 1000000ULL) / total_weight) : 0;
+  }
+  if (achieved_ppm != NULL) {
+    uint64_t used = (nu_sched->params != NULL) ? nu_sched->params->fair_micros : 0;
+    *achieved_ppm = (this->fair_total_micros > 0) ? (uint32_t) ((used * 1000000ULL) / this->fair_total_micros) : 0;
+  }
+  return true;
+}
+
+
+/**
+* Charges a fair-share dispatch to the schedule that ran. Called from the main loop, after the run.
+*/
+void Scheduler::chargeFairShare(ScheduleItem *obj, uint32_t cost_micros) {
+  ScheduleParams *p_data = obj->params;    // Never allocate on the dispatch path.
+  uint32_t weight  = (p_data != NULL) ? p_data->weight : SCHEDULER_DEFAULT_WEIGHT;
+  uint64_t advance = ((uint64_t) cost_micros * SCHEDULER_DEFAULT_WEIGHT) / weight;
+  obj->vruntime   += (advance > 0) ? (uint32_t) advance : 1;   // Even a free run costs something.
+  if (p_data != NULL) p_data->fair_micros += cost_micros;
+  this->fair_total_micros += cost_micros;
+}
+
+
+/**
+* Adds a newly-due schedule to the ready heap. A schedule that has been asleep is brought up to
+*  min_vruntime, so that it can't make up for lost time by hogging the CPU.
+*  Called with interrupts off (or from the ISR).
+*/
+void Scheduler::readyPush(ScheduleItem *obj) {
+  if ((int32_t) (obj->vruntime - this->min_vruntime) < 0) obj->vruntime = this->min_vruntime;
+  this->heapPush(&this->ready_heap, obj);
+}
+
+
+/**
+* Returns the longest that the given schedule has been kept waiting between release and dispatch, in ticks.
+*/
+uint32_t Scheduler::getMaxWait(uint32_t g_pid) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  return (nu_sched != NULL) ? this->maxWait(nu_sched) : 0;
+}
+
+
+/**
+* The longest wait seen, counting the one in progress (so that a schedule that is being starved shows up).
+*/
+uint32_t Scheduler::maxWait(ScheduleItem *obj) {
+  uint32_t wait = (obj->thread_fire) ? (this->elapsed_ticks - obj->release_tick) : 0;
+  return (wait > obj->max_wait_ticks) ? wait : obj->max_wait_ticks;
+}
+
+
+/**
+* Base priority plus aging, for a due schedule. Saturates rather than wrapping.
+*/
+uint32_t Scheduler::effectivePriority(ScheduleItem *obj) {
+  uint32_t priority = 0;
+  uint32_t rate     = SCHEDULER_DEFAULT_AGING_RATE;
+  if (obj->params != NULL) {
+    priority = obj->params->priority;
+    rate     = obj->params->aging_rate;
+  }
+  uint32_t wait = this->elapsed_ticks - obj->release_tick;
+  if ((rate > 0) && (wait > (0xFFFFFFFF - priority) / rate)) return 0xFFFFFFFF;
+  return priority + (rate * wait);
+}
+
+
+/**
+* Returns the due schedule that should be dispatched next under the current policy, or NULL if none are due.
+*/
+ScheduleItem* Scheduler::pickNextSchedule() {
+  ScheduleItem *current = this->schedule_root_node;
+  ScheduleItem *best    = NULL;
+  uint32_t best_priority = 0;
+  if (this->getPendingSchedules() == 0) return NULL;   // Nothing released. Don't bother walking.
+  if (this->ready_heap.items != NULL) {
+    SCHEDULER_ENTER_CRITICAL();
+    while ((best == NULL) && (this->ready_heap.count > 0)) {
+      current = this->ready_heap.items[0];
+      this->heapRemove(&this->ready_heap, current);
+      if (current->thread_fire) {
+        if (this->suspended(current)) this->clearRelease(current);
+        else best = current;
+      }                                           // Otherwise the release was cancelled. Drop it.
+    }
+    if ((best != NULL) && ((int32_t) (best->vruntime - this->min_vruntime) > 0)) this->min_vruntime = best->vruntime;
+    SCHEDULER_EXIT_CRITICAL();
+    return best;
+  }
+  while (current != NULL) {
+    if (current->thread_fire && this->suspended(current)) {
+      this->clearRelease(current);                // Released before the mode went up.
+    }
+    else if (current->thread_fire) {
+      if (this->dispatch_policy != SCHEDULER_POLICY_AGING) return current;
+      uint32_t priority = this->effectivePriority(current);
+      if ((best == NULL) || (priority > best_priority)) {
+        best          = current;
+        best_priority = priority;
+      }
+    }
+    current = current->next;
+  }
+  return best;
+}
+
+
+/****************************************************************************************************
+* Mixed criticality. See Note 10 in the header.                                                     *
+****************************************************************************************************/
+
+/**
+* Sets the given schedule's criticality level, and what happens to it while the mode is above that level.
+*/
+boolean Scheduler::setCriticality(uint32_t g_pid, uint8_t level, uint8_t degrade_action, uint8_t stretch_factor) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    ScheduleParams *p_data  = this->getParams(nu_sched);
+    if (p_data != NULL) {
+      p_data->degrade_action = degrade_action;
+      p_data->stretch_factor = (stretch_factor > 0) ? stretch_factor : 1;
+      nu_sched->criticality  = level;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* Sets the lateness (in ticks) that raises the mode, and how many quiet ticks it takes to step back down.
+*/
+void Scheduler::setModeSwitch(uint32_t lateness_ticks, uint32_t recovery_ticks) {
+  this->crit_lateness_ticks = lateness_ticks;
+  this->crit_recovery_ticks = recovery_ticks;
+}
+
+
+uint8_t Scheduler::getCriticalityMode() {
+  return this->crit_mode;
+}
+
+
+uint32_t Scheduler::getModeSwitchCount() {
+  return this->crit_switch_count;
+}
+
+
+/**
+* Is the given schedule suspended by the current mode?
+*/
+boolean Scheduler::suspended(ScheduleItem *obj) {
+  if (obj->criticality >= this->crit_mode) return false;
+  return ((obj->params == NULL) || (obj->params->degrade_action == SCHEDULER_DEGRADE_SUSPEND));
+}
+
+
+/**
+* The period the given schedule runs at in the current mode.
+*/
+uint32_t Scheduler::periodOf(ScheduleItem *obj) {
+  if ((obj->criticality < this->crit_mode) && (obj->params != NULL) && (obj->params->degrade_action == SCHEDULER_DEGRADE_STRETCH)) {
+    return obj->thread_period * obj->params->stretch_factor;
+  }
+  return obj->thread_period;
+}
+
+
+/**
+* Should the given schedule's runs be timed against its execution estimate?
+*/
+boolean Scheduler::criticalityWatched(ScheduleItem *obj) {
+  return ((obj->criticality > 0) && (obj->criticality >= this->crit_mode) && (obj->params != NULL) && (obj->params->exec_estimate_micros > 0));
+}
+
+
+/**
+* Raises the mode to the given level (if it is below it), and restarts the recovery timer.
+*/
+void Scheduler::raiseCriticality(uint8_t level) {
+  if (level < this->crit_mode) return;
+  this->crit_last_trigger = this->elapsed_ticks;
+  if (level > this->crit_mode) {
+    this->crit_mode = level;
+    this->crit_switch_count++;
+  }
+}
+
+
+/**
+* Called after every dispatch. Raises the mode if a schedule at or above it overran or was dispatched late.
+*/
+void Scheduler::checkCriticality(ScheduleItem *obj, uint32_t exec_micros, uint32_t lateness) {
+  if ((obj->criticality == 0) || (obj->criticality < this->crit_mode)) return;
+  if (this->criticalityWatched(obj) && (exec_micros > obj->params->exec_estimate_micros)) {
+    this->raiseCriticality(obj->criticality);
+  }
+  else if ((this->crit_lateness_ticks > 0) && (lateness > this->crit_lateness_ticks)) {
+    this->raiseCriticality(obj->criticality);
+  }
+}
+
+
+/****************************************************************************************************
+* Load shedding. See Note 11 in the header.                                                         *
+****************************************************************************************************/
+
+/**
+* Turns load shedding on, with the given limit on the backlog of sheddable work (in microseconds),
+*  or off, if the limit is zero.
+*/
+boolean Scheduler::setLoadShedding(uint32_t backlog_micros) {
+  if (backlog_micros == 0) {
+    this->shed_limit_micros = 0;
+    this->heapFree(&this->shed_heap);
+    this->shed_backlog = 0;
+    return true;
+  }
+  if (!this->heapGrow(&this->shed_heap, this->schedule_count)) return false;
+  SCHEDULER_ENTER_CRITICAL();
+  this->shed_limit_micros = backlog_micros;
+  ScheduleItem *current = this->schedule_root_node;
+  while (current != NULL) {
+    if (current->thread_fire && (current->shed_pos == 0) && (current->params != NULL) && (current->params->utility > 0)) {
+      this->shedPush(current);
+    }
+    current = current->next;
+  }
+  SCHEDULER_EXIT_CRITICAL();
+  return true;
+}
+
+
+/**
+* Sets the value of one run of the given schedule. The shedder drops the least valuable work per microsecond first.
+*/
+boolean Scheduler::setScheduleUtility(uint32_t g_pid, uint16_t utility) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    ScheduleParams *p_data  = this->getParams(nu_sched);
+    if (p_data != NULL) {
+      SCHEDULER_ENTER_CRITICAL();
+      this->shedRemove(nu_sched);     // Its place in the heap depends on its utility.
+      p_data->utility = utility;
+      if ((utility > 0) && nu_sched->thread_fire && (this->shed_heap.items != NULL)) this->shedPush(nu_sched);
+      SCHEDULER_EXIT_CRITICAL();
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* How many releases of the given schedule have been shed? Pass 0 for the total over all schedules.
+*/
+uint32_t Scheduler::getShedCount(uint32_t g_pid) {
+  if (g_pid == 0) return this->shed_total;
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  return ((nu_sched != NULL) && (nu_sched->params != NULL)) ? nu_sched->params->shed_count : 0;
+}
+
+
+/**
+* Queues a pending release for shedding, and adds its cost to the backlog. Called with interrupts off (or from the ISR).
+*/
+void Scheduler::shedPush(ScheduleItem *obj) {
+  uint32_t cost = this->executionEstimate(obj);
+  obj->params->shed_cost = (cost > 0) ? cost : 1;
+  this->shed_backlog    += obj->params->shed_cost;
+  this->heapPush(&this->shed_heap, obj);
+}
+
+
+/**
+* Takes a release out of the shed queue (because it ran, or was shed). Called with interrupts off.
+*/
+void Scheduler::shedRemove(ScheduleItem *obj) {
+  if (obj->shed_pos != 0) {
+    this->heapRemove(&this->shed_heap, obj);
+    this->shed_backlog -= obj->params->shed_cost;
+  }
+}
+
+
+/**
+* Called before each service pass. If the backlog is over the limit, drops the pending release that
+*  is worth least per microsecond. Entries whose release was cancelled some other way are dropped as
+*  they come up, without being counted.
+*/
+void Scheduler::shedLoad() {
+  SCHEDULER_ENTER_CRITICAL();
+  while ((this->shed_backlog > this->shed_limit_micros) && (this->shed_heap.count > 0)) {
+    ScheduleItem *victim = this->shed_heap.items[0];
+    this->shedRemove(victim);
+    if (victim->thread_fire) {
+      this->clearRelease(victim);
+      victim->params->shed_count++;
+      this->shed_total++;
+      break;
+    }
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/****************************************************************************************************
+* Static cyclic executive. See Note 12 in the header.                                               *
+****************************************************************************************************/
+
+static uint32_t cyclic_gcd(uint32_t a, uint32_t b) {
+  while (b != 0) {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+
+/**
+* Would the given schedule go in the cyclic table?
+*/
+static boolean cyclic_candidate(ScheduleItem *obj) {
+  boolean has_callback = (obj->schedule_callback != NULL) || ((obj->params != NULL) && (obj->params->batch_callback != NULL));
+  return (obj->thread_enabled && (obj->thread_mode == SCHEDULE_MODE_PERIODIC) && (obj->budget_data == NULL) && (obj->thread_recurs == -1) && has_callback);
+}
+
+
+/**
+* The period the given schedule gets in the table. Snapping rounds down, so a schedule never runs less often than it asked to.
+*/
+uint32_t Scheduler::cyclicPeriod(ScheduleItem *obj, uint32_t base, boolean snap_harmonic) {
+  if (!snap_harmonic) return obj->thread_period;
+  uint32_t period = base;
+  while ((period <= (obj->thread_period >> 1)) && (period <= 0x7FFFFFFF)) period = period << 1;
+  return period;
+}
+
+
+/**
+* Builds the cyclic table from the current schedules and starts running it, with the first frame starting now.
+*/
+boolean Scheduler::buildCyclicSchedule(boolean snap_harmonic, uint32_t max_hyperperiod) {
+  // Gather the schedules, in rate-monotonic order.
+  uint16_t count = 0;
+  uint32_t base  = 0;
+  ScheduleItem *current = this->schedule_root_node;
+  while (current != NULL) {
+    if (cyclic_candidate(current)) {
+      if (this->executionEstimate(current) == 0) return false;    // No WCET, no guarantee.
+      if ((base == 0) || (current->thread_period < base)) base = current->thread_period;
+      count++;
+    }
+    current = current->next;
+  }
+  if (count == 0) return false;
+  ScheduleItem **members = (ScheduleItem **) malloc(sizeof(ScheduleItem*) * count);
+  uint32_t *periods      = (uint32_t *) malloc(sizeof(uint32_t) * count);
+  if ((members == NULL) || (periods == NULL)) {
+    if (members != NULL) free(members);
+    if (periods != NULL) free(periods);
+    return false;
+  }
+  uint16_t n = 0;
+  for (current = this->schedule_root_node; current != NULL; current = current->next) {
+    if (!cyclic_candidate(current)) continue;
+    uint32_t period = this->cyclicPeriod(current, base, snap_harmonic);
+    uint16_t i = n++;
+    while ((i > 0) && (periods[i - 1] > period)) {     // Insertion sort. Stable, so list order breaks ties.
+      members[i] = members[i - 1];
+      periods[i] = periods[i - 1];
+      i--;
+    }
+    members[i] = current;
+    periods[i] = period;
+  }
+
+  // Minor and major frames.
+  uint32_t minor  = periods[0];
+  uint64_t major  = periods[0];
+  uint32_t jobs   = 0;
+  boolean  fits   = true;
+  for (uint16_t i = 1; (i < count) && fits; i++) {
+    minor = cyclic_gcd(minor, periods[i]);
+    major = (major / cyclic_gcd((uint32_t) (major % periods[i]), periods[i]) * periods[i]);
+    if ((major > max_hyperperiod) || (major > 0xFFFFFFFF)) fits = false;
+  }
+  if (fits && ((major > max_hyperperiod) || ((major / minor) > 0xFFFE))) fits = false;
+  for (uint16_t i = 0; (i < count) && fits; i++) {
+    jobs += (uint32_t) (major / periods[i]);
+    if (jobs > 0xFFFF) fits = false;
+  }
+
+  // First-fit every job into the earliest frame between its release and deadline that has room.
+  uint16_t  frames       = fits ? (uint16_t) (major / minor) : 0;
+  uint64_t  room         = (uint64_t) minor * this->tick_micros;
+  uint32_t  capacity     = (room > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) room;
+  uint32_t *frame_used   = fits ? (uint32_t *) malloc(sizeof(uint32_t) * frames) : NULL;
+  uint16_t *job_frame    = fits ? (uint16_t *) malloc(sizeof(uint16_t) * jobs) : NULL;
+  uint16_t *frame_start  = fits ? (uint16_t *) malloc(sizeof(uint16_t) * (frames + 1)) : NULL;
+  ScheduleItem **table   = fits ? (ScheduleItem **) malloc(sizeof(ScheduleItem*) * jobs) : NULL;
+  fits = fits && (frame_used != NULL) && (job_frame != NULL) && (frame_start != NULL) && (table != NULL);
+  if (fits) {
+    memset(frame_used, 0x00, sizeof(uint32_t) * frames);
+    memset(frame_start, 0x00, sizeof(uint16_t) * (frames + 1));
+    uint16_t job = 0;
+    for (uint16_t i = 0; (i < count) && fits; i++) {
+      uint32_t wcet = this->executionEstimate(members[i]);
+      uint32_t span = periods[i] / minor;
+      for (uint32_t release = 0; (release < frames) && fits; release += span) {
+        uint32_t f = release;
+        while ((f < release + span) && ((uint64_t) frame_used[f] + wcet > capacity)) f++;
+        if (f == release + span) fits = false;
+        else {
+          frame_used[f] += wcet;
+          frame_start[f + 1]++;
+          job_frame[job++] = f;
+        }
+      }
+    }
+  }
+  if (fits) {
+    for (uint16_t f = 0; f < frames; f++) frame_start[f + 1] += frame_start[f];   // Counts to offsets.
+    memset(frame_used, 0x00, sizeof(uint32_t) * frames);                         // Reused as fill counts.
+    uint16_t job = 0;
+    for (uint16_t i = 0; i < count; i++) {
+      for (uint32_t release = 0; release < frames; release += periods[i] / minor) {
+        uint16_t f = job_frame[job++];
+        table[frame_start[f] + frame_used[f]++] = members[i];
+      }
+    }
+    this->stopCyclicSchedule();
+    SCHEDULER_ENTER_CRITICAL();
+    this->cyclic_frame_start  = frame_start;
+    this->cyclic_frames       = frames;
+    this->cyclic_minor        = minor;
+    this->cyclic_tick         = 0;
+    this->cyclic_frame_count  = 0;
+    this->cyclic_frame_tick   = this->elapsed_ticks;
+    this->cyclic_cursor_frame = 0;
+    this->cyclic_cursor_job   = 0;
+    this->cyclic_overruns     = 0;
+    this->cyclic_jobs         = table;
+    SCHEDULER_EXIT_CRITICAL();
+  }
+  else {
+    if (frame_start != NULL) free(frame_start);
+    if (table != NULL) free(table);
+  }
+  if (frame_used != NULL) free(frame_used);
+  if (job_frame != NULL) free(job_frame);
+  free(members);
+  free(periods);
+  return fits;
+}
+
+
+/**
+* Throws the cyclic table away, and goes back to dynamic dispatch. Schedules carry on counting down from
+*  wherever they were when the table was built.
+*/
+void Scheduler::stopCyclicSchedule() {
+  if (this->cyclic_jobs == NULL) return;
+  SCHEDULER_ENTER_CRITICAL();
+  ScheduleItem **table  = this->cyclic_jobs;
+  uint16_t *frame_start = this->cyclic_frame_start;
+  this->cyclic_jobs        = NULL;
+  this->cyclic_frame_start = NULL;
+  this->cyclic_frames      = 0;
+  this->cyclic_minor       = 0;
+  SCHEDULER_EXIT_CRITICAL();
+  free(table);
+  free(frame_start);
+}
+
+
+uint32_t Scheduler::getCyclicMinorFrame() {
+  return this->cyclic_minor;
+}
+
+
+uint32_t Scheduler::getCyclicMajorFrame() {
+  return this->cyclic_minor * this->cyclic_frames;
+}
+
+
+uint32_t Scheduler::getCyclicOverruns() {
+  return this->cyclic_overruns;
+}
+
+
+/**
+* Is the given schedule listed in the cyclic table?
+*/
+boolean Scheduler::inCyclicSchedule(ScheduleItem *obj) {
+  if (this->cyclic_jobs != NULL) {
+    for (uint16_t i = 0; i < this->cyclic_frame_start[this->cyclic_frames]; i++) {
+      if (this->cyclic_jobs[i] == obj) return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* The next job listed for the current frame, or NULL if the frame's jobs have all been run. O(1).
+*/
+ScheduleItem* Scheduler::nextCyclicJob() {
+  uint32_t frame;
+  {
+    SCHEDULER_ENTER_CRITICAL();    // The ISR counts frames, and a bare 32-bit read can tear on 8-bit cores.
+    frame = this->cyclic_frame_count;
+    SCHEDULER_EXIT_CRITICAL();
+  }
+  if (frame != this->cyclic_cursor_frame) {
+    uint16_t old_frame = this->cyclic_cursor_frame % this->cyclic_frames;
+    if (this->cyclic_frame_start[old_frame] + this->cyclic_cursor_job < this->cyclic_frame_start[old_frame + 1]) {
+      this->cyclic_overruns++;                              // The frame ended with jobs left to run.
+    }
+    uint32_t skipped  = frame - this->cyclic_cursor_frame - 1;   // Frames we never got to at all...
+    if (skipped > 0) {
+      uint16_t rest      = skipped % this->cyclic_frames;
+      uint16_t busy      = 0;     // ...but only those with jobs can overrun. Per major frame...
+      uint16_t busy_rest = 0;     // ...and in the partial one left over.
+      for (uint16_t i = 0; i < this->cyclic_frames; i++) {
+        uint16_t f  = (old_frame + 1 + i) % this->cyclic_frames;
+        if (this->cyclic_frame_start[f] < this->cyclic_frame_start[f + 1]) {
+          busy++;
+          if (i < rest) busy_rest++;
+        }
+      }
+      this->cyclic_overruns += (skipped / this->cyclic_frames) * busy + busy_rest;
+    }
+    this->cyclic_cursor_frame = frame;
+    this->cyclic_cursor_job   = 0;
+  }
+  uint16_t idx = frame % this->cyclic_frames;
+  while (this->cyclic_frame_start[idx] + this->cyclic_cursor_job < this->cyclic_frame_start[idx + 1]) {
+    ScheduleItem *obj = this->cyclic_jobs[this->cyclic_frame_start[idx] + this->cyclic_cursor_job++];
+    if (obj->thread_enabled) {
+      SCHEDULER_ENTER_CRITICAL();
+      obj->release_tick = this->cyclic_frame_tick;
+      if (!obj->thread_fire) {     // A trigger may have released it already. Count it once.
+        obj->thread_fire = true;
+        this->released_total++;    // Shared with releases from the ISR.
+      }
+      SCHEDULER_EXIT_CRITICAL();
+      return obj;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+* Fills batch and contexts with the given batch schedule, followed by the other due schedules that share
+*  its callback (in list order), and takes them all off the ready and shed heaps. Returns how many there are.
+*/
+uint16_t Scheduler::collectBatch(ScheduleItem *obj, ScheduleItem** batch, void** contexts) {
+  uint16_t count = 1;
+  BatchFunctionPointer callback = obj->params->batch_callback;
+  ScheduleItem *current = this->schedule_root_node;
+  while ((current != NULL) && (count < SCHEDULER_BATCH_MAX)) {
+    if ((current != obj) && current->thread_fire && (current->params != NULL) && (current->params->batch_callback == callback) && (current->budget_data == NULL) && !this->suspended(current)) {
+      if ((current->ready_pos != 0) || (current->shed_pos != 0)) {
+        SCHEDULER_ENTER_CRITICAL();
+        this->heapRemove(&this->ready_heap, current);
+        this->shedRemove(current);
+        SCHEDULER_EXIT_CRITICAL();
+      }
+      batch[count]    = current;
+      contexts[count] = current->params->context;
+      count++;
+    }
+    current = current->next;
+  }
+  return count;
+}
+
+
+/**
+* Called for each schedule that has just been run. Clears its release and counts down its recurrence,
+*  disabling or reaping it if that was its last run.
+*/
+void Scheduler::finishRun(ScheduleItem *obj) {
+  this->clearRelease(obj);
+  if (obj->budget_data != NULL) {
+    if (this->budgetReady(obj)) {    // Keep going while there is budget and work.
+      SCHEDULER_ENTER_CRITICAL();
+      this->releaseSchedule(obj);
+      SCHEDULER_EXIT_CRITICAL();
+    }
+  }
+
+  switch (obj->thread_recurs) {
+    case -1:           // Do nothing. Schedule runs indefinitely.
+      break;
+    case 0:            // Disable (and remove?) the schedule.
+      if (obj->autoclear) {
+        this->destroyScheduleItem(obj);
+      }
+      else {
+        this->setEnabled(obj, false); // Disable the schedule...
+        this->clearRelease(obj);      // ...mark it as serviced.
+        this->setTimeToWait(obj, obj->thread_period);   // ...and reset the timer.
+      }
+      break;
+    default:           // Decrement the run count.
+      obj->thread_recurs--;
+      break;
+  }
+}
+
+
+/**
+* This is the function that is called from the main loop to offload big
+*  tasks into idle CPU time. If many scheduled items have fired, function
+*  will only execute the first one it finds.
+*  Therefore: Lower-numbered schedules are de facto higher-priority (unless
+*  another dispatch policy has been chosen).
+*/
+void Scheduler::serviceScheduledEvents() {
+  uint32_t profile_start_time = 0;
+  uint32_t profile_last_time  = 0;
+  uint32_t origin_time        = micros();
+  uint32_t dispatch_tick      = 0;
+  uint32_t profiled_mask      = 0;
+  uint32_t sampled_mask       = 0;
+  boolean  fair               = false;
+  boolean  watched            = false;
+  boolean  timed              = false;
+  uint32_t exec_micros        = 0;
+  boolean  productive         = false;
+  uint16_t count              = 1;
+  ScheduleItem *batch[SCHEDULER_BATCH_MAX];
+  void*    contexts[SCHEDULER_BATCH_MAX];
+  ScheduleItem *current = NULL;
+  if ((SCHEDULER_LOAD_ACQUIRE(this->post_head) != this->post_tail) && (this->runPosted() > 0)) productive = true;
+  if (this->cyclic_jobs != NULL) {
+    current = this->nextCyclicJob();
+  }
+  else {
+    if (this->shed_limit_micros > 0) this->shedLoad();
+    current = this->pickNextSchedule();
+  }
+  if (current != NULL) {
+    if (current->shed_pos != 0) {
+      SCHEDULER_ENTER_CRITICAL();
+      this->shedRemove(current);
+      SCHEDULER_EXIT_CRITICAL();
+    }
+    batch[0]    = current;
+    contexts[0] = (current->params != NULL) ? current->params->context : NULL;
+    if ((current->params != NULL) && (current->params->batch_callback != NULL) && (this->cyclic_jobs == NULL)) {
+      count = this->collectBatch(current, batch, contexts);
+    }
+    if ((current->schedule_callback != NULL) || (current->budget_data != NULL) || ((current->params != NULL) && (current->params->batch_callback != NULL))) {
+      fair = (this->ready_heap.items != NULL);
+      for (uint16_t i = 0; i < count; i++) {
+        uint32_t wait = this->elapsed_ticks - batch[i]->release_tick;
+        if (wait > batch[i]->max_wait_ticks) batch[i]->max_wait_ticks = wait;
+        if (this->scheduleBeingProfiled(batch[i])) {
+          profiled_mask |= (1UL << i);
+          if (this->sampleThisRun(batch[i]->prof_data)) sampled_mask |= (1UL << i);
+        }
+        if (this->criticalityWatched(batch[i])) watched = true;
+      }
+      timed = (sampled_mask != 0) || fair || watched;
+      if (timed) profile_start_time = micros();
+
+      dispatch_tick = this->elapsed_ticks;
+      this->running_batch       = batch;
+      this->running_batch_count = count;
+      this->runSchedule(current, contexts, count);
+      this->running_batch_count = 0;
+
+      if (timed) {
+        profile_last_time     = micros();
+        profile_start_time   += this->profiler_overhead;   // Don't charge the schedule for our own timing.
+        exec_micros           = ((int32_t) (profile_last_time - profile_start_time) > 0) ? (profile_last_time - profile_start_time) : 0;  // Rollover invarient.
+        exec_micros           = exec_micros / count;       // Each member of a batch pays an equal share.
+      }
+      for (uint16_t i = 0; i < count; i++) {
+        if (fair) this->chargeFairShare(batch[i], exec_micros);
+        if (sampled_mask & (1UL << i)) {
+          this->recordProfile(batch[i], exec_micros, dispatch_tick - batch[i]->release_tick, profile_last_time);
+        }
+        else if (profiled_mask & (1UL << i)) {
+          this->recordUnsampledRun(batch[i]->prof_data);
+        }
+        this->checkCriticality(batch[i], exec_micros, dispatch_tick - batch[i]->release_tick);
+      }
+    }
+    for (uint16_t i = 0; i < count; i++) this->finishRun(batch[i]);
+    productive = true;
+  }
+  uint32_t pass_time = micros() - origin_time;
+  this->stats_sequence++;
+  SCHEDULER_BARRIER();
+  if (productive) this->productive_loops++;
+  this->overhead = pass_time;
+  this->total_loops++;
+  SCHEDULER_BARRIER();
+  this->stats_sequence++;
+  if (this->dump_job != NULL) this->advanceDump();
+  if (!productive && (this->idle_count > 0)) this->runIdleWork(origin_time);
+}
+
+
+
+/****************************************************************************************************
+* Pausing and shifting time. See Note 21 in the header.                                             *
+****************************************************************************************************/
+
+uint32_t Scheduler::scheduleClock() {
+  return this->elapsed_ticks - this->epoch_offset;
+}
+
+
+void Scheduler::pause() {
+  this->paused = true;
+}
+
+
+void Scheduler::resume() {
+  this->paused = false;
+}
+
+
+boolean Scheduler::isPaused() {
+  return this->paused;
+}
+
+
+/**
+* Pushes every deadline back by the given number of ticks (after a blackout, say), keeping their phases.
+*  O(1) for timeouts, and for periodic schedules with absolute deadlines. Countdowns have to be visited.
+*/
+void Scheduler::shiftAll(uint32_t ticks) {
+  SCHEDULER_ENTER_CRITICAL();
+  this->epoch_offset += ticks;
+  if (!this->absolute_deadlines) {
+    for (ScheduleItem *current = this->tick_head; current != NULL; current = current->tick_next) {
+      if (current->budget_data == NULL) current->thread_time_to_wait += ticks;
+    }
+  }
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Chooses between countdowns (the default) and absolute deadlines for periodic schedules. Every schedule
+*  keeps its time to wait across the change.
+*/
+void Scheduler::setDeadlineMode(boolean absolute) {
+  if (absolute == this->absolute_deadlines) return;
+  SCHEDULER_ENTER_CRITICAL();
+  for (ScheduleItem *current = this->tick_head; current != NULL; current = current->tick_next) {
+    if (current->budget_data == NULL) {
+      if (absolute) current->thread_deadline = this->scheduleClock() + current->thread_time_to_wait + 1;
+      else current->thread_time_to_wait = this->timeToWait(current);
+    }
+  }
+  this->absolute_deadlines = absolute;
+  SCHEDULER_EXIT_CRITICAL();
+}
+
+
+/**
+* Does the given schedule keep an absolute deadline in place of its countdown?
+*/
+boolean Scheduler::hasDeadline(ScheduleItem *obj) {
+  return (this->absolute_deadlines && (obj->thread_mode == SCHEDULE_MODE_PERIODIC) && (obj->budget_data == NULL));
+}
+
+
+/**
+* Sets how long the given schedule waits before its next release. A countdown of ticks releases on the
+*  (ticks + 1)th tick from now, so an absolute deadline is set to match.
+*/
+void Scheduler::setTimeToWait(ScheduleItem *obj, uint32_t ticks) {
+  obj->thread_time_to_wait = ticks;
+  if (this->hasDeadline(obj) && obj->thread_enabled) obj->thread_deadline = this->scheduleClock() + ticks + 1;
+}
+
+
+
+/****************************************************************************************************
+* Posted one-shot work. See Note 20 in the header.                                                  *
+****************************************************************************************************/
+
+/**
+* Queues the given function to be run (with the given context) at the start of the next service pass.
+*  Returns false if the queue is full. The slot is claimed by compare-and-swap on post_head, so any
+*  number of ISRs and threads can post at once.
+*/
+boolean Scheduler::post(PostedFunctionPointer callback, void* context) {
+  if (callback == NULL) return false;
+  PostedWork *slot  = NULL;
+  uint8_t pos  = SCHEDULER_LOAD_ACQUIRE(this->post_head);
+  while (true) {
+    slot = &this->post_ring[pos % SCHEDULER_POST_SLOTS];
+    int8_t lap  = (int8_t) (SCHEDULER_LOAD_ACQUIRE(slot->sequence) - pos);
+    if (lap == 0) {
+      if (SCHEDULER_CAS(this->post_head, pos, (uint8_t) (pos + 1))) break;   // Ours. Otherwise pos is reloaded.
+    }
+    else if (lap < 0) {
+      return false;      // Full. The slot still holds work from the lap before.
+    }
+    else {
+      pos = SCHEDULER_LOAD_ACQUIRE(this->post_head);   // Another poster got here first.
+    }
+  }
+  slot->callback = callback;
+  slot->context  = context;
+  SCHEDULER_STORE_RELEASE(slot->sequence, (uint8_t) (pos + 1));
+  return true;
+}
+
+
+uint8_t Scheduler::getPostBacklog() {
+  return (uint8_t) (SCHEDULER_LOAD_ACQUIRE(this->post_head) - this->post_tail);
+}
+
+
+/**
+* Runs the work that was posted before this pass began, oldest first. Stops early at a slot that is
+*  still being filled. Returns how many were run.
+*/
+uint8_t Scheduler::runPosted() {
+  uint8_t count  = 0;
+  uint8_t head   = SCHEDULER_LOAD_ACQUIRE(this->post_head);
+  while (this->post_tail != head) {
+    uint8_t pos  = this->post_tail;
+    PostedWork *slot  = &this->post_ring[pos % SCHEDULER_POST_SLOTS];
+    if (SCHEDULER_LOAD_ACQUIRE(slot->sequence) != (uint8_t) (pos + 1)) break;   // The poster is still filling it.
+    PostedFunctionPointer callback  = slot->callback;
+    void* context  = slot->context;
+    SCHEDULER_STORE_RELEASE(slot->sequence, (uint8_t) (pos + SCHEDULER_POST_SLOTS));  // Free the slot first, so it can be posted to again.
+    this->post_tail = pos + 1;
+    callback(context);
+    count++;
+  }
+  return count;
+}
+
+
+
+/****************************************************************************************************
+* Background work for idle passes. See Note 15 in the header.                                       *
+****************************************************************************************************/
+
+/**
+* Queues a step of background work. It will be run (with the given context) in idle passes for as long
+*  as it keeps returning true. The same work may be queued more than once.
+*  Returns false if the queue is full.
+*/
+boolean Scheduler::addIdleWork(IdleWorkPointer work, void* context) {
+  if ((work == NULL) || (this->idle_count >= SCHEDULER_IDLE_SLOTS)) return false;
+  this->idle_work[this->idle_count].callback = work;
+  this->idle_work[this->idle_count].context  = context;
+  this->idle_count++;
+  return true;
+}
+
+
+/**
+* Takes the first matching item out of the queue. The rest keep their order.
+*  Returns false if it wasn't queued.
 */
-boolean Scheduler::willRunAgain(uint32_t g_pid) {
-  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
-  if (nu_sched != NULL) {
-    if (nu_sched->thread_enabled) {
-      if ((nu_sched->thread_recurs == -1) || (nu_sched->thread_recurs > 0)) {
-	return true;
-      }
+boolean Scheduler::removeIdleWork(IdleWorkPointer work, void* context) {
+  for (uint8_t i = 0; i < this->idle_count; i++) {
+    if ((this->idle_work[i].callback == work) && (this->idle_work[i].context == context)) {
+      memmove(&this->idle_work[i], &this->idle_work[i + 1], (this->idle_count - i - 1) * sizeof(IdleWork));
+      this->idle_count--;
+      if (i < this->idle_cursor) this->idle_cursor--;
+      return true;
     }
   }
   return false;
 }
 
 
-boolean Scheduler::scheduleEnabled(uint32_t g_pid) {
-  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
-  if (nu_sched != NULL) {
-    return nu_sched->thread_enabled;
-  }
-  return false;
+void Scheduler::setIdleBudget(uint32_t micros) {
+  this->idle_budget_micros = micros;
 }
 
 
-/**
-* Enable a previously disabled schedule.
-*  Returns true on success and false on failure.
-*/
-boolean Scheduler::enableSchedule(uint32_t g_pid) {
-  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
-  if (nu_sched != NULL) {
-    nu_sched->thread_enabled = true;
-    return true;
-  }
-  return false;
+uint8_t Scheduler::getIdleWorkCount() {
+  return this->idle_count;
 }
 
 
-boolean Scheduler::delaySchedule(ScheduleItem *obj, uint32_t by_ms) {
-  if (obj != NULL) {
-    obj->thread_time_to_wait = by_ms;
-    obj->thread_enabled = true;
-    return true;
-  }
-  return false;
+uint32_t Scheduler::getIdleRuns() {
+  return this->idle_runs;
 }
 
+
 /**
-* Causes a given schedule's TTW (time-to-wait) to be set to the value we provide (this time only).
-* If the schedule wasn't enabled before, it will be when we return.
+* Runs background work until the budget (counted from origin_time) is spent, every item has had a turn,
+*  or a schedule comes due. Always runs at least one step.
 */
-boolean Scheduler::delaySchedule(uint32_t g_pid, uint32_t by_ms) {
-  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
-  if (nu_sched != NULL) {
-    this->delaySchedule(nu_sched, by_ms);
-    return true;
+void Scheduler::runIdleWork(uint32_t origin_time) {
+  uint8_t turns = 0;
+  while (turns < this->idle_count) {
+    if (this->idle_cursor >= this->idle_count) this->idle_cursor = 0;
+    IdleWork work = this->idle_work[this->idle_cursor];
+    boolean  more = work.callback(work.context);
+    this->idle_runs++;
+    turns++;
+    if (more) this->idle_cursor++;
+    else this->removeIdleWork(work.callback, work.context);  // Leaves the cursor on the next item.
+    if ((micros() - origin_time) >= this->idle_budget_micros) break;
+    if (this->getPendingSchedules() > 0) break;           // Real work has come due.
   }
-  return false;
 }
 
+
+
+/****************************************************************************************************
+* Deferred logging. See Note 16 in the header.                                                      *
+****************************************************************************************************/
+
 /**
-* Causes a given schedule's TTW (time-to-wait) to be reset to its period.
-* If the schedule wasn't enabled before, it will be when we return.
+* Background work that keeps the log drained. Stays queued until logging is stopped.
 */
-boolean Scheduler::delaySchedule(uint32_t g_pid) {
-  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
-  if (nu_sched != NULL) {
-    this->delaySchedule(nu_sched, nu_sched->thread_period);
-    return true;
-  }
-  return false;
+static boolean log_flush_step(void* context) {
+  ((Scheduler*) context)->flushLog(1);
+  return true;
 }
 
 
-
 /**
-* Call this function to push the schedules forward.
+* Starts deferred logging into a ring of at least the given number of records. The ring is rounded up to
+*  a power of two (of no more than 16384), so that positions can wrap at 65536 and still land on the
+*  same slot. Any previous ring, and the records in it, are thrown away. Returns false if there wasn't
+*  memory.
 */
-void Scheduler::advanceScheduler() {
-  ScheduleItem *current  = this->schedule_root_node;
-  while (current != NULL) {
-    if (current->thread_enabled) {
-      if (current->thread_time_to_wait > 0) current->thread_time_to_wait--;
-      else {
-        current->thread_fire = true;
-        current->thread_time_to_wait = current->thread_period;
-      }
-    }
-    current = current->next;
+boolean Scheduler::beginLogging(uint16_t slots, LogOutput output) {
+  this->stopLogging();
+  if ((slots < 2) || (slots > 0x4000)) return false;
+  uint16_t size  = 2;
+  while (size < slots) size <<= 1;
+  LogRecord *ring  = (LogRecord *) malloc(size * sizeof(LogRecord));
+  if (ring == NULL) return false;
+  memset(ring, 0x00, size * sizeof(LogRecord));
+  for (uint16_t i = 0; i < size; i++) ring[i].sequence = i;
+  this->log_head   = 0;
+  this->log_tail   = 0;
+  this->log_slots  = size;
+  this->log_output = output;
+  this->log_ring   = ring;
+  if ((output != NULL) && !this->addIdleWork(log_flush_step, this)) {
+    this->stopLogging();
+    return false;
   }
+  return true;
 }
 
 
 /**
-* Call to disable a given schedule.
-*  Will reset the time_to_wait so that if the schedule is re-enabled, it doesn't fire sooner than expected.
-*  Returns true on success and false on failure.
+* Stops logging and frees the ring. Records not yet read are lost.
 */
-boolean Scheduler::disableSchedule(uint32_t g_pid) {
-  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
-  if (nu_sched != NULL) {
-      nu_sched->thread_enabled = false;
-      nu_sched->thread_fire    = false;
-      nu_sched->thread_time_to_wait = nu_sched->thread_period;
-      return true;
+void Scheduler::stopLogging() {
+  if (this->log_ring != NULL) {
+    this->removeIdleWork(log_flush_step, this);
+    SCHEDULER_ENTER_CRITICAL();
+    LogRecord *ring  = this->log_ring;
+    this->log_ring   = NULL;
+    this->log_slots  = 0;
+    SCHEDULER_EXIT_CRITICAL();
+    free(ring);
   }
-  return false;
 }
 
 
 /**
-* Will remove the indicated schedule and wipe its profiling data.
-* In case this gets called from the schedule's service function (IE,
-*   if the schedule tries to delete itself), let it expire this run
-*   rather than ripping the rug out from under ourselves.
-* Returns true on success and false on failure.
+* Records a format string and its raw arguments, to be formatted later. Nothing is formatted here.
+*  Returns false (and counts the drop) if the ring is full, or if logging hasn't been started.
 */
-boolean Scheduler::removeSchedule(uint32_t g_pid) {
-  ScheduleItem *obj  = findNodeByPID(g_pid);
-  if (obj != NULL) {
-    if (obj->pid != this->currently_executing) {
-      this->destroyScheduleItem(obj);
+boolean Scheduler::logEvent(const char* format, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3) {
+  LogRecord *ring  = this->log_ring;
+  if (ring == NULL) return false;
+  LogRecord *rec   = NULL;
+  uint16_t pos  = SCHEDULER_LOAD_ACQUIRE(this->log_head);
+  while (true) {
+    rec = &ring[pos & (this->log_slots - 1)];
+    int16_t lap  = (int16_t) (SCHEDULER_LOAD_ACQUIRE(rec->sequence) - pos);
+    if (lap == 0) {
+      if (SCHEDULER_CAS(this->log_head, pos, (uint16_t) (pos + 1))) break;   // Ours. Otherwise pos is reloaded.
     }
-    else { 
-      obj->autoclear = true;
-      obj->thread_recurs = 0;
+    else if (lap < 0) {
+      SCHEDULER_ATOMIC_ADD(this->log_dropped, 1);   // Full. The slot still holds a record from the lap before.
+      return false;
+    }
+    else {
+      pos = SCHEDULER_LOAD_ACQUIRE(this->log_head);   // Another writer got here first.
     }
   }
+  rec->format  = format;
+  rec->tick    = this->elapsed_ticks;
+  rec->args[0] = a0;
+  rec->args[1] = a1;
+  rec->args[2] = a2;
+  rec->args[3] = a3;
+  SCHEDULER_STORE_RELEASE(rec->sequence, (uint16_t) (pos + 1));
   return true;
 }
 
 
 /**
-* This is the function that is called from the main loop to offload big
-*  tasks into idle CPU time. If many scheduled items have fired, function
-*  will only execute the first one it finds.
-*  Therefore: Lower-numbered schedules are de facto higher-priority.
+* Takes the oldest record off the ring, if it is ready. Main loop only.
 */
-void Scheduler::serviceScheduledEvents() {
-  uint32_t profile_start_time = 0;
-  uint32_t profile_last_time  = 0;
-  uint32_t origin_time        = micros();
-  ScheduleItem *current = this->schedule_root_node;
-  ScheduleItem *temp;
-  while (current != NULL) {
-    temp = NULL;
-    if (current->thread_fire) {
-      if (current->schedule_callback != NULL) {
-        if (this->scheduleBeingProfiled(current)) profile_start_time = micros();
-        
-        this->currently_executing = current->pid;
-        ((void (*)(void)) current->schedule_callback)();    // Call the schedule's service function.
-        this->currently_executing = 0;
-
-        if (this->scheduleBeingProfiled(current)) {
-          profile_last_time     = micros();
-          current->prof_data->last_time_micros   = max(profile_start_time, profile_last_time) - min(profile_start_time, profile_last_time);  // Rollover invarient.
-          current->prof_data->worst_time_micros  = max(current->prof_data->worst_time_micros, current->prof_data->last_time_micros);
-          current->prof_data->best_time_micros   = min(current->prof_data->best_time_micros, current->prof_data->last_time_micros);
-          current->prof_data->execution_count++;
-        }            
-      }
-      current->thread_fire = false;
-         
-      switch (current->thread_recurs) {
-        case -1:           // Do nothing. Schedule runs indefinitely.
-          break;
-        case 0:            // Disable (and remove?) the schedule.
-          if (current->autoclear) {
-            temp = current->next;  // Careful.....
-            this->destroyScheduleItem(current);
-            current = temp;
-          }
-          else {
-            current->thread_enabled = false;  // Disable the schedule...
-            current->thread_fire    = false;  // ...mark it as serviced.
-            current->thread_time_to_wait = current->thread_period;  // ...and reset the timer.
-          }
-          break;
-        default:           // Decrement the run count.
-          current->thread_recurs--;
-          break;
+boolean Scheduler::takeLogRecord(LogRecord* out) {
+  if (this->log_ring == NULL) return false;
+  uint16_t pos  = this->log_tail;
+  LogRecord *rec  = &this->log_ring[pos & (this->log_slots - 1)];
+  if (SCHEDULER_LOAD_ACQUIRE(rec->sequence) != (uint16_t) (pos + 1)) return false;   // Empty, or still being written.
+  memcpy(out, rec, sizeof(LogRecord));
+  SCHEDULER_STORE_RELEASE(rec->sequence, (uint16_t) (pos + this->log_slots));   // Free for the next lap.
+  this->log_tail = pos + 1;
+  return true;
+}
+
+
+/**
+* Formats up to max_records records and hands each to the output given to beginLogging().
+*  Returns how many were taken.
+*/
+uint16_t Scheduler::flushLog(uint16_t max_records) {
+  uint16_t count  = 0;
+  LogRecord rec;
+  char line[SCHEDULER_LOG_LINE];
+  while ((count < max_records) && this->takeLogRecord(&rec)) {
+    if (this->log_output != NULL) {
+      int offset  = snprintf(line, sizeof(line), "%lu: ", (unsigned long) rec.tick);
+      if ((offset > 0) && (offset < (int) sizeof(line))) {
+        snprintf(line + offset, sizeof(line) - offset, rec.format, (unsigned long) rec.args[0], (unsigned long) rec.args[1], (unsigned long) rec.args[2], (unsigned long) rec.args[3]);
       }
-      this->productive_loops++;
-      break;
+      this->log_output(line);
     }
-    current = (current == NULL) ? temp : current->next;
+    count++;
   }
-  this->overhead = micros() - origin_time;
-  this->total_loops++;
+  return count;
+}
+
+
+/**
+* Copies out (and takes off the ring) up to max_records raw records, oldest first. Returns how many.
+*/
+uint16_t Scheduler::readLog(LogRecord* out, uint16_t max_records) {
+  uint16_t count  = 0;
+  while ((count < max_records) && this->takeLogRecord(&out[count])) count++;
+  return count;
+}
+
+
+uint16_t Scheduler::getLogBacklog() {
+  if (this->log_ring == NULL) return 0;
+  return (uint16_t) (SCHEDULER_LOAD_ACQUIRE(this->log_head) - this->log_tail);
+}
+
+
+uint32_t Scheduler::getLogDropped() {
+  return this->log_dropped;
 }
 
 
@@ -634,15 +3500,34 @@ void Scheduler::serviceScheduledEvents() {
 *  memory after you've finished writing the string to a serial port, or whatever you do with it.    *
 ****************************************************************************************************/
 
+static const char* PROFILER_HEADER  = "[PID, PROFILING, EXECUTED, LAST, BEST, WORST, SAMPLED, +/-PERMILLE]\n";
+static const char* SCHEDULE_HEADER  = "[PID, ENABLED, TTF, PERIOD, RECURS, PENDING, AUTOCLEAR, PROFILED, MAXWAIT]\n";
+
+/**
+* Row formatters shared by the dumps below and by startDump(). Each returns what snprintf() does.
+*/
+int Scheduler::formatProfilingRow(ScheduleItem *current, char* buf, size_t len) {
+  return snprintf(buf, len, "[%lu, %s, %lu, %lu, %lu, %lu, %lu, %lu]\n", current->pid, ((current->prof_data->profiling_active) ? "YES":"NO"), current->prof_data->execution_count, current->prof_data->last_time_micros, current->prof_data->best_time_micros, current->prof_data->worst_time_micros, current->prof_data->sample_count, this->samplingConfidence(current->prof_data));
+}
+
+int Scheduler::formatProfilerTrailer(char* buf, size_t len) {
+  return snprintf(buf, len, "[PROFILER OVERHEAD, %lu, RESOLUTION, %lu]\n", (unsigned long) this->profiler_overhead, (unsigned long) this->profiler_resolution);
+}
+
+int Scheduler::formatScheduleRow(ScheduleItem *current, char* buf, size_t len) {
+  return snprintf(buf, len, "[%lu, %s, %lu, %lu, %d, %s, %s, %s, %lu]\n", current->pid, ((current->thread_enabled) ? "YES":"NO"), this->timeToWait(current), current->thread_period, current->thread_recurs, ((current->thread_fire) ? "YES":"NO"), ((current->autoclear) ? "YES":"NO"), ((current->prof_data != NULL && current->prof_data->profiling_active) ? "YES":"NO"), this->maxWait(current));
+}
+
+
 /**
 * Dumps profiling data for the schedule with the given PID.
 */
 char* Scheduler::dumpProfilingData(uint32_t g_pid) {
-  const char* PROFILER_HEADER = "[PID, PROFILING, EXECUTED, LAST, BEST, WORST]\n";
   char* return_value  = NULL;
   const uint16_t EXPECTED_SIZE_OF_LINE = 140;
   uint16_t num_strs  = this->getTotalSchedules();
   if (num_strs > 0) {
+    num_strs += 2;    // Room for the header and the calibration line.
     ScheduleItem *current  = this->schedule_root_node;
     char* temp_str_out  = (char*) alloca(EXPECTED_SIZE_OF_LINE * num_strs);  // Arbitrary. Slightly too big. Should not overflow.
     if (temp_str_out != NULL) {
@@ -654,13 +3539,15 @@ char* Scheduler::dumpProfilingData(uint32_t g_pid) {
       while (current != NULL) {
         if (current->prof_data != NULL) {
 	  if (((g_pid == 0) | (g_pid == current->pid)) | (g_pid == 0xFFFFFFFF)) {
-            sprintf(temp_str, "[%lu, %s, %lu, %lu, %lu, %lu]\n", current->pid, ((current->prof_data->profiling_active) ? "YES":"NO"), current->prof_data->execution_count, current->prof_data->last_time_micros, current->prof_data->best_time_micros, current->prof_data->worst_time_micros);
+            this->formatProfilingRow(current, temp_str, EXPECTED_SIZE_OF_LINE);
             strcat(temp_str_out, temp_str);
             memset(temp_str, 0x00, EXPECTED_SIZE_OF_LINE);
 	  }
         }
         current = current->next;
       }
+      this->formatProfilerTrailer(temp_str, EXPECTED_SIZE_OF_LINE);
+      strcat(temp_str_out, temp_str);
       return_value = strdup(temp_str_out);
     }
     else {
@@ -686,7 +3573,6 @@ char* Scheduler::dumpProfilingData() {
 * Dumps schedule data. Pass 0 as the first parameter to get all processes.
 */
 char* Scheduler::dumpScheduleData(uint32_t g_pid, boolean actives_only) {
-  const char* SCHEDULE_HEADER = "[PID, ENABLED, TTF, PERIOD, RECURS, PENDING, AUTOCLEAR, PROFILED]\n";
   char* return_value  = NULL;
   const uint16_t EXPECTED_SIZE_OF_LINE = 146;
   uint16_t num_strs  = this->getTotalSchedules();
@@ -701,7 +3587,7 @@ char* Scheduler::dumpScheduleData(uint32_t g_pid, boolean actives_only) {
   
       while (current != NULL) {
 	if (((g_pid == 0) | (g_pid == current->pid)) | !actives_only){
-          sprintf(temp_str, "[%lu, %s, %lu, %lu, %d, %s, %s, %s]\n", current->pid, ((current->thread_enabled) ? "YES":"NO"), current->thread_time_to_wait, current->thread_period, current->thread_recurs, ((current->thread_fire) ? "YES":"NO"), ((current->autoclear) ? "YES":"NO"), ((current->prof_data != NULL && current->prof_data->profiling_active) ? "YES":"NO"));
+          this->formatScheduleRow(current, temp_str, EXPECTED_SIZE_OF_LINE);
           strcat(temp_str_out, temp_str);
           memset(temp_str, 0x00, EXPECTED_SIZE_OF_LINE);
 	}
@@ -740,3 +3626,427 @@ char* Scheduler::dumpScheduleData(uint32_t g_pid) {
 char* Scheduler::dumpAllActiveScheduleData() {
   return this->dumpScheduleData(0, true);
 }
+
+
+/**
+* Starts writing a dump to the given sink. It is written from serviceScheduledEvents(), at most a row
+*  per pass, and never more than available() says the sink will take. See Note 17.
+*  Returns false if a dump is already running, or there wasn't memory.
+*/
+boolean Scheduler::startDump(uint8_t kind, uint32_t g_pid, DumpWrite write, DumpAvailable available) {
+  if ((write == NULL) || (this->dump_job != NULL)) return false;
+  if ((kind != SCHEDULER_DUMP_SCHEDULES) && (kind != SCHEDULER_DUMP_PROFILING)) return false;
+  DumpJob *job  = (DumpJob *) malloc(sizeof(DumpJob));
+  if (job == NULL) return false;
+  memset(job, 0x00, sizeof(DumpJob));
+  job->write     = write;
+  job->available = available;
+  job->cursor    = this->schedule_root_node;
+  job->pid       = g_pid;
+  job->kind      = kind;
+  this->dump_job = job;
+  return true;
+}
+
+
+boolean Scheduler::dumpInProgress() {
+  return (this->dump_job != NULL);
+}
+
+
+/**
+* Abandons the dump that is being written, possibly part way through a row.
+*/
+void Scheduler::cancelDump() {
+  if (this->dump_job != NULL) {
+    free(this->dump_job);
+    this->dump_job = NULL;
+  }
+}
+
+
+/**
+* Formats the next row of the given dump into its line. Returns false once there are no more.
+*/
+boolean Scheduler::nextDumpRow(DumpJob* job) {
+  int len  = 0;
+  switch (job->stage) {
+    case 0:            // The header.
+      len = snprintf(job->line, SCHEDULER_DUMP_LINE, "%s", (job->kind == SCHEDULER_DUMP_PROFILING) ? PROFILER_HEADER : SCHEDULE_HEADER);
+      job->stage = 1;
+      break;
+    case 1:            // A row per matching schedule.
+      while ((job->cursor != NULL) && (len == 0)) {
+        ScheduleItem *current  = job->cursor;
+        job->cursor = current->next;
+        if ((job->pid == 0) || (job->pid == current->pid)) {
+          if (job->kind == SCHEDULER_DUMP_SCHEDULES) len = this->formatScheduleRow(current, job->line, SCHEDULER_DUMP_LINE);
+          else if (current->prof_data != NULL) len = this->formatProfilingRow(current, job->line, SCHEDULER_DUMP_LINE);
+        }
+      }
+      if (len > 0) break;
+      job->stage = 2;
+      if (job->kind == SCHEDULER_DUMP_PROFILING) {
+        len = this->formatProfilerTrailer(job->line, SCHEDULER_DUMP_LINE);
+        break;
+      }
+      job->stage = 3;  // Schedule dumps have no trailer.
+      return false;
+    default:
+      job->stage = 3;
+      return false;
+  }
+  if (len >= SCHEDULER_DUMP_LINE) len = SCHEDULER_DUMP_LINE - 1;   // Truncated.
+  job->line_len = (len > 0) ? len : 0;
+  job->line_pos = 0;
+  return true;
+}
+
+
+/**
+* One step of the running dump: formats the next row if the last one is out, and writes as much of the
+*  row as the sink will take without blocking. Ends the dump once everything has been written.
+*/
+void Scheduler::advanceDump() {
+  DumpJob *job  = this->dump_job;
+  if (job->line_pos >= job->line_len) {
+    if (!this->nextDumpRow(job)) {
+      this->cancelDump();
+      return;
+    }
+  }
+  size_t room  = job->line_len - job->line_pos;
+  if (job->available != NULL) {
+    size_t ready  = job->available();
+    if (ready < room) room = ready;
+  }
+  if (room > 0) job->line_pos += job->write(job->line + job->line_pos, room);
+}
+
+
+/**
+* Dumps the cyclic table, one minor frame per line, with the PIDs of the jobs in the order they will run.
+*/
+char* Scheduler::dumpCyclicSchedule() {
+  if (this->cyclic_jobs == NULL) return strdup("NO CYCLIC SCHEDULE");
+  uint16_t jobs    = this->cyclic_frame_start[this->cyclic_frames];
+  size_t   length  = 96 + (this->cyclic_frames * 24) + (jobs * 12);
+  char* return_value = (char*) malloc(length);
+  if (return_value != NULL) {
+    char* cursor = return_value;
+    cursor += sprintf(cursor, "[MINOR, %lu, MAJOR, %lu, OVERRUNS, %lu]\n", (unsigned long) this->cyclic_minor, (unsigned long) this->getCyclicMajorFrame(), (unsigned long) this->cyclic_overruns);
+    for (uint16_t f = 0; f < this->cyclic_frames; f++) {
+      cursor += sprintf(cursor, "[%u, %lu:", f, (unsigned long) (f * this->cyclic_minor));
+      for (uint16_t i = this->cyclic_frame_start[f]; i < this->cyclic_frame_start[f + 1]; i++) {
+        cursor += sprintf(cursor, " %lu", (unsigned long) this->cyclic_jobs[i]->pid);
+      }
+      cursor += sprintf(cursor, "]\n");
+    }
+  }
+  return return_value;
+}
+
+
+
+/****************************************************************************************************
+* OpenMetrics (Prometheus) text exporter.                                                           *
+* Unlike the dump functions above, these do not allocate, and do not use sprintf. Output is built   *
+*  a token at a time, straight into the caller's buffer or through a small chunk on the stack.      *
+****************************************************************************************************/
+
+#define METRICS_HISTOGRAM_EXECUTION  0
+#define METRICS_HISTOGRAM_LATENESS   1
+
+typedef struct sch_metrics_sink_t {
+  char*   out;          // Buffer mode: where to write. NULL in file-descriptor mode.
+  size_t  out_len;      // Buffer mode: size of out.
+  size_t  total;        // Number of bytes produced so far, whether or not they fit.
+  int     fd;           // File-descriptor mode: where to write. -1 in buffer mode.
+  boolean failed;       // File-descriptor mode: a write() failed.
+  size_t  chunk_used;   // File-descriptor mode: bytes waiting in chunk.
+  char    chunk[256];   // File-descriptor mode: staging, so that we don't call write() per token.
+} MetricsSink;
+
+
+static void metricsFlush(MetricsSink *sink) {
+  #if defined(SCHEDULER_HAS_FILE_DESCRIPTORS)
+  size_t done  = 0;
+  while (!sink->failed && (done < sink->chunk_used)) {
+    ssize_t written  = write(sink->fd, sink->chunk + done, sink->chunk_used - done);
+    if (written <= 0) sink->failed = true;
+    else done += (size_t) written;
+  }
+  #endif
+  sink->chunk_used = 0;
+}
+
+
+static void metricsPut(MetricsSink *sink, const char* str, size_t len) {
+  if (sink->out != NULL) {
+    if (sink->total < sink->out_len) {
+      size_t room  = sink->out_len - sink->total;
+      memcpy(sink->out + sink->total, str, (len < room) ? len : room);
+    }
+  }
+  else {
+    while (len > 0) {
+      if (sink->chunk_used == sizeof(sink->chunk)) metricsFlush(sink);
+      size_t room  = sizeof(sink->chunk) - sink->chunk_used;
+      size_t n     = (len < room) ? len : room;
+      memcpy(sink->chunk + sink->chunk_used, str, n);
+      sink->chunk_used += n;
+      sink->total      += n;
+      str += n;
+      len -= n;
+    }
+    return;
+  }
+  sink->total += len;
+}
+
+
+static void metricsStr(MetricsSink *sink, const char* str) {
+  metricsPut(sink, str, strlen(str));
+}
+
+
+static void metricsU64(MetricsSink *sink, uint64_t value) {
+  char digits[20];
+  uint8_t i = sizeof(digits);
+  do {
+    digits[--i] = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0);
+  metricsPut(sink, digits + i, sizeof(digits) - i);
+}
+
+
+// A label value, with backslashes, quotes and newlines escaped.
+static void metricsEscaped(MetricsSink *sink, const char* str) {
+  const char* run  = str;
+  for (; *str != '\0'; str++) {
+    const char* escape  = NULL;
+    if (*str == '\\')      escape = "\\\\";
+    else if (*str == '"')  escape = "\\\"";
+    else if (*str == '\n') escape = "\\n";
+    if (escape != NULL) {
+      metricsPut(sink, run, str - run);
+      metricsStr(sink, escape);
+      run = str + 1;
+    }
+  }
+  metricsPut(sink, run, str - run);
+}
+
+
+// One complete line: "name value\n".
+static void metricsLine(MetricsSink *sink, const char* name, uint64_t value) {
+  metricsStr(sink, name);
+  metricsPut(sink, " ", 1);
+  metricsU64(sink, value);
+  metricsPut(sink, "\n", 1);
+}
+
+
+/**
+* Writes {pid="...",name="..."} (or {pid="...",name="...",le="..."} if le is given).
+*/
+void Scheduler::writeMetricLabels(MetricsSink *sink, ScheduleItem *obj, const char* le) {
+  metricsStr(sink, "{pid=\"");
+  metricsU64(sink, obj->pid);
+  metricsPut(sink, "\"", 1);
+  if ((obj->params != NULL) && (obj->params->name != NULL)) {
+    metricsStr(sink, ",name=\"");
+    metricsEscaped(sink, obj->params->name);
+    metricsPut(sink, "\"", 1);
+  }
+  if (le != NULL) {
+    metricsStr(sink, ",le=\"");
+    metricsStr(sink, le);
+    metricsPut(sink, "\"", 1);
+  }
+  metricsPut(sink, "}", 1);
+}
+
+
+/**
+* Writes one histogram family, with a series for every profiled schedule.
+*/
+void Scheduler::writeMetricHistogram(MetricsSink *sink, const char* family, uint8_t histogram) {
+  ScheduleProfile snapshot;
+  char le[12];
+  metricsStr(sink, "# TYPE ");
+  metricsStr(sink, family);
+  metricsStr(sink, " histogram\n");
+  for (ScheduleItem *current = this->schedule_root_node; current != NULL; current = current->next) {
+    if (!this->copyProfile(current, &snapshot)) continue;
+    uint32_t *buckets  = (histogram == METRICS_HISTOGRAM_LATENESS) ? snapshot.lateness_histogram : snapshot.histogram;
+    uint8_t   count    = (histogram == METRICS_HISTOGRAM_LATENESS) ? SCHEDULER_LATENESS_BUCKETS : SCHEDULER_HISTOGRAM_BUCKETS;
+    uint64_t  running  = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      running += buckets[i];
+      if (i == count - 1) {
+        strcpy(le, "+Inf");
+      }
+      else {
+        // Bucket i holds values below 2^i, so its (integer) upper bound is 2^i - 1.
+        MetricsSink le_sink;
+        memset(&le_sink, 0x00, sizeof(le_sink));
+        le_sink.out     = le;
+        le_sink.out_len = sizeof(le) - 1;
+        metricsU64(&le_sink, (1ULL << i) - 1);
+        le[le_sink.total] = '\0';
+      }
+      metricsStr(sink, family);
+      metricsStr(sink, "_bucket");
+      this->writeMetricLabels(sink, current, le);
+      metricsPut(sink, " ", 1);
+      metricsU64(sink, running);
+      metricsPut(sink, "\n", 1);
+    }
+    metricsStr(sink, family);
+    metricsStr(sink, "_count");
+    this->writeMetricLabels(sink, current, NULL);
+    metricsPut(sink, " ", 1);
+    metricsU64(sink, running);
+    metricsPut(sink, "\n", 1);
+    metricsStr(sink, family);
+    metricsStr(sink, "_sum");
+    this->writeMetricLabels(sink, current, NULL);
+    metricsPut(sink, " ", 1);
+    metricsU64(sink, (histogram == METRICS_HISTOGRAM_LATENESS) ? snapshot.total_lateness : snapshot.total_time_micros);
+    metricsPut(sink, "\n", 1);
+  }
+}
+
+
+/**
+* Writes the whole exposition. Each metric family is written in its own pass over the list, since
+*  OpenMetrics wants all of a family's samples together.
+*/
+void Scheduler::writeMetrics(MetricsSink *sink) {
+  SchedulerStats stats;
+  ScheduleProfile snapshot;
+  ScheduleItem *current;
+  this->snapshotStats(&stats);
+
+  metricsStr(sink, "# TYPE scheduler_loops counter\n");
+  metricsLine(sink, "scheduler_loops_total", stats.total_loops);
+  metricsStr(sink, "# TYPE scheduler_productive_loops counter\n");
+  metricsLine(sink, "scheduler_productive_loops_total", stats.productive_loops);
+  metricsStr(sink, "# TYPE scheduler_overhead_microseconds gauge\n");
+  metricsLine(sink, "scheduler_overhead_microseconds", stats.overhead);
+  metricsStr(sink, "# TYPE scheduler_idle_work_runs counter\n");
+  metricsLine(sink, "scheduler_idle_work_runs_total", this->idle_runs);
+  metricsStr(sink, "# TYPE scheduler_overruns counter\n");
+  metricsLine(sink, "scheduler_overruns_total", this->overrun_count);
+  metricsStr(sink, "# TYPE scheduler_profiler_overhead_microseconds gauge\n");
+  metricsLine(sink, "scheduler_profiler_overhead_microseconds", this->profiler_overhead);
+  metricsStr(sink, "# TYPE scheduler_profiler_resolution_microseconds gauge\n");
+  metricsLine(sink, "scheduler_profiler_resolution_microseconds", this->profiler_resolution);
+  metricsStr(sink, "# TYPE scheduler_schedules gauge\n");
+  metricsLine(sink, "scheduler_schedules", this->schedule_count);
+
+  // Utilisation is kept in ppm. Print it as a ratio with six decimal places.
+  uint32_t utilisation  = this->getUtilisation();
+  char fraction[7];
+  uint32_t remainder    = utilisation % 1000000;
+  for (int8_t i = 5; i >= 0; i--) {
+    fraction[i] = '0' + (remainder % 10);
+    remainder /= 10;
+  }
+  fraction[6] = '\0';
+  metricsStr(sink, "# TYPE scheduler_utilisation_ratio gauge\nscheduler_utilisation_ratio ");
+  metricsU64(sink, utilisation / 1000000);
+  metricsPut(sink, ".", 1);
+  metricsStr(sink, fraction);
+  metricsPut(sink, "\n", 1);
+
+  metricsStr(sink, "# TYPE scheduler_schedule_enabled gauge\n");
+  for (current = this->schedule_root_node; current != NULL; current = current->next) {
+    metricsStr(sink, "scheduler_schedule_enabled");
+    this->writeMetricLabels(sink, current, NULL);
+    metricsStr(sink, current->thread_enabled ? " 1\n" : " 0\n");
+  }
+
+  metricsStr(sink, "# TYPE scheduler_schedule_executions counter\n");
+  for (current = this->schedule_root_node; current != NULL; current = current->next) {
+    if (!this->copyProfile(current, &snapshot)) continue;
+    metricsStr(sink, "scheduler_schedule_executions_total");
+    this->writeMetricLabels(sink, current, NULL);
+    metricsPut(sink, " ", 1);
+    metricsU64(sink, snapshot.execution_count);
+    metricsPut(sink, "\n", 1);
+  }
+
+  // Estimated from the sampled runs, if the schedule is sampled. See Note 7.
+  metricsStr(sink, "# TYPE scheduler_schedule_cpu_microseconds counter\n");
+  for (current = this->schedule_root_node; current != NULL; current = current->next) {
+    if (!this->copyProfile(current, &snapshot)) continue;
+    metricsStr(sink, "scheduler_schedule_cpu_microseconds_total");
+    this->writeMetricLabels(sink, current, NULL);
+    metricsPut(sink, " ", 1);
+    metricsU64(sink, this->scaledTotalTime(&snapshot));
+    metricsPut(sink, "\n", 1);
+  }
+
+  this->writeMetricHistogram(sink, "scheduler_schedule_execution_microseconds", METRICS_HISTOGRAM_EXECUTION);
+  this->writeMetricHistogram(sink, "scheduler_schedule_lateness_ticks", METRICS_HISTOGRAM_LATENESS);
+  metricsStr(sink, "# EOF\n");
+}
+
+
+/**
+* Gives the given schedule a name, for reports. The string is not copied.
+*  Returns false if the PID isn't found.
+*/
+boolean Scheduler::setScheduleName(uint32_t g_pid, const char* name) {
+  ScheduleItem *nu_sched  = findNodeByPID(g_pid);
+  if (nu_sched != NULL) {
+    ScheduleParams *p_data  = this->getParams(nu_sched);
+    if (p_data != NULL) {
+      p_data->name = name;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+* Renders the metrics into buf, snprintf() style. Returns the full length of the output, which
+*  may be more than len. The output is always NUL-terminated if len > 0.
+*/
+size_t Scheduler::exportMetrics(char* buf, size_t len) {
+  MetricsSink sink;
+  sink.out        = buf;
+  sink.out_len    = ((buf != NULL) && (len > 0)) ? len - 1 : 0;
+  sink.total      = 0;
+  sink.fd         = -1;
+  sink.failed     = false;
+  sink.chunk_used = 0;
+  if (buf == NULL) sink.out = (char*) "";   // Just measure. Nothing is written, since out_len is zero.
+  this->writeMetrics(&sink);
+  if ((buf != NULL) && (len > 0)) buf[(sink.total < sink.out_len) ? sink.total : sink.out_len] = '\0';
+  return sink.total;
+}
+
+
+#if defined(SCHEDULER_HAS_FILE_DESCRIPTORS)
+/**
+* Renders the metrics straight to the given file descriptor (a file, pipe or socket).
+*  Returns false if a write failed.
+*/
+boolean Scheduler::exportMetrics(int fd) {
+  MetricsSink sink;
+  sink.out        = NULL;
+  sink.out_len    = 0;
+  sink.total      = 0;
+  sink.fd         = fd;
+  sink.failed     = false;
+  sink.chunk_used = 0;
+  this->writeMetrics(&sink);
+  metricsFlush(&sink);
+  return !sink.failed;
+}
+#endif
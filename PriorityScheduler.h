@@ -40,35 +40,402 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <alloca.h>
 #endif
 
+#if defined(__unix__) || defined(__APPLE__)
+  #define SCHEDULER_HAS_FILE_DESCRIPTORS
+#endif
+
+
+// Number of slots in the timing wheel that holds timeout schedules. Must be a power of two.
+#ifndef SCHEDULER_WHEEL_SLOTS
+  #define SCHEDULER_WHEEL_SLOTS    16
+#endif
+
+// Number of outstanding replenishments a sporadic server can keep track of.
+#ifndef SCHEDULER_SPORADIC_REFILLS
+  #define SCHEDULER_SPORADIC_REFILLS  4
+#endif
+
+// Number of power-of-two buckets in each profiled schedule's execution-time histogram.
+//  Bucket 0 counts runs of 0us, and bucket i counts runs of [2^(i-1), 2^i)us. The last bucket catches the rest.
+#ifndef SCHEDULER_HISTOGRAM_BUCKETS
+  #define SCHEDULER_HISTOGRAM_BUCKETS  20
+#endif
+
+// Number of power-of-two buckets in each profiled schedule's lateness histogram, counted in ticks.
+#ifndef SCHEDULER_LATENESS_BUCKETS
+  #define SCHEDULER_LATENESS_BUCKETS   12
+#endif
+
+// Number of budget overruns the watchdog remembers.
+#ifndef SCHEDULER_OVERRUN_LOG
+  #define SCHEDULER_OVERRUN_LOG       4
+#endif
+
+// Number of dry runs calibrateProfiler() times. The fastest is taken as the profiler's own overhead.
+#ifndef SCHEDULER_CALIBRATION_RUNS
+  #define SCHEDULER_CALIBRATION_RUNS  32
+#endif
+
+// How many times beginProfiling() will try to calibrate while micros() isn't running. Each try can spin
+//  for a while, so after this many the profiler runs uncalibrated.
+#ifndef SCHEDULER_CALIBRATION_TRIES
+  #define SCHEDULER_CALIBRATION_TRIES 3
+#endif
+
+// Number of runtime anomalies the profiler remembers.
+#ifndef SCHEDULER_ANOMALY_LOG
+  #define SCHEDULER_ANOMALY_LOG       8
+#endif
+
+// How many runs in a row the runtime average must be off its baseline before it counts as a regression.
+#ifndef SCHEDULER_REGRESSION_RUNS
+  #define SCHEDULER_REGRESSION_RUNS  16
+#endif
+
+// Number of background work items that may be queued for idle passes. See Note 15.
+#ifndef SCHEDULER_IDLE_SLOTS
+  #define SCHEDULER_IDLE_SLOTS      8
+#endif
+
+// Number of raw arguments a deferred log record carries (fixed, to match logEvent()), and the longest
+//  line it is formatted into. See Note 16.
+#define SCHEDULER_LOG_ARGS          4
+#ifndef SCHEDULER_LOG_LINE
+  #define SCHEDULER_LOG_LINE        64
+#endif
+
+// Longest row of a dump. Both the schedule and profiler rows fit.
+#define SCHEDULER_DUMP_LINE         146
+
+// Number of slots in the post() run queue. A power of two, no more than 64. See Note 20.
+#ifndef SCHEDULER_POST_SLOTS
+  #define SCHEDULER_POST_SLOTS      8
+#endif
+#if (SCHEDULER_POST_SLOTS & (SCHEDULER_POST_SLOTS - 1)) || (SCHEDULER_POST_SLOTS > 64)
+  #error SCHEDULER_POST_SLOTS must be a power of two, no more than 64.
+#endif
+
+// Finest resolution of the PWM engine, in bits. See Note 19.
+#define SCHEDULER_PWM_MAX_BITS      16
+
+// Initial number of buckets in the PID index. Must be a power of two. Grows as schedules are added.
+#ifndef SCHEDULER_PID_BUCKETS
+  #define SCHEDULER_PID_BUCKETS     8
+#endif
+
+// How a schedule is timed...
+#define SCHEDULE_MODE_PERIODIC   0x00   // Counts down thread_time_to_wait on every tick (or, see Note 21, waits for thread_deadline).
+#define SCHEDULE_MODE_TIMEOUT    0x01   // Absolute deadline in the timing wheel. See Note 3.
+
+// What triggerSchedule() does with a trigger. See Note 18.
+#define SCHEDULER_TRIGGER_IMMEDIATE  0x00   // Release at once. The default.
+#define SCHEDULER_TRIGGER_DEBOUNCE   0x01   // Release once there have been no triggers for window ticks.
+#define SCHEDULER_TRIGGER_THROTTLE   0x02   // Release at most once per window ticks. Triggers in between are dropped.
+#define SCHEDULER_TRIGGER_BUCKET     0x03   // Token bucket. Bursts of up to burst releases, refilled at one per window ticks.
+
+// Admission control policies. See Note 5.
+#define SCHEDULER_ADMIT_NONE     0x00   // Anything goes. The default.
+#define SCHEDULER_ADMIT_RM       0x01   // Liu & Layland bound for rate-monotonic priorities.
+#define SCHEDULER_ADMIT_EDF      0x02   // Total utilisation may not exceed 100%.
+
+// Most schedules that a single batch callback will be handed at once. See Note 13.
+#ifndef SCHEDULER_BATCH_MAX
+  #define SCHEDULER_BATCH_MAX   16
+#endif
+#if (SCHEDULER_BATCH_MAX > 32) || (SCHEDULER_BATCH_MAX < 1)
+  #error SCHEDULER_BATCH_MAX must be between 1 and 32.
+#endif
+
+// How serviceScheduledEvents() chooses between schedules that are due. See Note 8.
+#define SCHEDULER_POLICY_LIST_ORDER  0x00   // The first one in the list. The default.
+#define SCHEDULER_POLICY_AGING       0x01   // The highest priority, plus aging_rate for every tick it has waited.
+#define SCHEDULER_POLICY_FAIR_SHARE  0x02   // The smallest virtual runtime. See Note 9.
+
+// Aging rate of schedules that haven't been given one.
+#ifndef SCHEDULER_DEFAULT_AGING_RATE
+  #define SCHEDULER_DEFAULT_AGING_RATE  1
+#endif
+
+// Weight of schedules that haven't been given one. A schedule's virtual runtime advances by
+//  cost * SCHEDULER_DEFAULT_WEIGHT / weight, so this is also the weight at which it advances in microseconds.
+#ifndef SCHEDULER_DEFAULT_WEIGHT
+  #define SCHEDULER_DEFAULT_WEIGHT  1024
+#endif
+
+// What happens to a schedule while the scheduler is in a criticality mode above its own. See Note 10.
+#define SCHEDULER_DEGRADE_SUSPEND  0x00   // It is not released (and pending releases are dropped). The default.
+#define SCHEDULER_DEGRADE_STRETCH  0x01   // Its period is multiplied by its stretch factor.
+
+// How many times a snapshot will be retried before giving up on a writer that is mid-update.
+#ifndef SCHEDULER_SNAPSHOT_RETRIES
+  #define SCHEDULER_SNAPSHOT_RETRIES  8
+#endif
+
+// Keeps the compiler (and, on hosts, the CPU) from reordering around a sequence counter.
+#if defined(__AVR__)
+  #define SCHEDULER_BARRIER()          __asm__ __volatile__ ("" ::: "memory")
+#else
+  #define SCHEDULER_BARRIER()          __sync_synchronize()
+#endif
+
+// Things that getTopSchedules() can rank by...
+#define SCHEDULER_RANK_CPU_SHARE   0x00   // Share of all profiled CPU time, in ppm.
+#define SCHEDULER_RANK_WORST       0x01   // Worst execution time, in microseconds.
+#define SCHEDULER_RANK_P99         0x02   // 99th percentile execution time (histogram bucket upper bound), in microseconds.
+#define SCHEDULER_RANK_LATENESS    0x03   // Worst lateness (release to dispatch), in ticks.
+#define SCHEDULER_RANK_EXECUTIONS  0x04   // Number of executions.
+
+// Kinds of runtime anomaly. See Note 6.
+#define SCHEDULER_ANOMALY_OUTLIER     0x01   // A single run was more than k standard deviations off the average.
+#define SCHEDULER_ANOMALY_REGRESSION  0x02   // The average has drifted away from the saved baseline.
+
+// Used to guard state that is shared between the tick ISR and the main loop. EXIT puts the interrupt
+//  state back as ENTER found it, so sections may nest, and may be entered from an ISR. They only hold
+//  off interrupts on the calling core.
+// Where there is no way to read the interrupt state, they fall back on noInterrupts() and interrupts(),
+//  counting the depth so that only the outermost EXIT turns interrupts back on. That outermost EXIT
+//  turns them on even if they were off before, as it would in an ISR. Define both macros before
+//  including this header to supply your own.
+#if defined(SCHEDULER_ENTER_CRITICAL) && defined(SCHEDULER_EXIT_CRITICAL)
+  // Supplied by the sketch.
+#elif defined(__AVR__)
+  #define SCHEDULER_ENTER_CRITICAL()   uint8_t _sch_sreg = SREG; cli()
+  #define SCHEDULER_EXIT_CRITICAL()    SREG = _sch_sreg
+#elif defined(__arm__) && (defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_BASE__) || defined(__ARM_ARCH_8M_MAIN__))
+  #define SCHEDULER_ENTER_CRITICAL()   uint32_t _sch_primask; __asm__ __volatile__ ("mrs %0, primask\n\tcpsid i" : "=r" (_sch_primask) :: "memory")
+  #define SCHEDULER_EXIT_CRITICAL()    __asm__ __volatile__ ("msr primask, %0" :: "r" (_sch_primask) : "memory")
+#elif defined(ESP8266)
+  #define SCHEDULER_ENTER_CRITICAL()   uint32_t _sch_ps = xt_rsil(15)
+  #define SCHEDULER_EXIT_CRITICAL()    xt_wsr_ps(_sch_ps)
+#else
+  #define SCHEDULER_COUNTED_CRITICAL
+  extern volatile uint8_t scheduler_critical_depth;
+  #define SCHEDULER_ENTER_CRITICAL()   do { noInterrupts(); scheduler_critical_depth++; } while (0)
+  #define SCHEDULER_EXIT_CRITICAL()    do { if (--scheduler_critical_depth == 0) interrupts(); } while (0)
+#endif
+
+// Lock-free access to the positions and counters of the post() ring and the deferred log, which any
+//  ISR or thread may write. SCHEDULER_CAS(x, expected, desired) stores desired in x if x still holds
+//  expected, and returns true. Otherwise it loads x's current value into expected and returns false.
+//  Cores that have no compare-and-swap instruction (and no library to stand in for one) are
+//  single-core, so a short critical section does the same job there, and also keeps loads and stores
+//  wider than the core's word from tearing. Define all four before including this header to supply
+//  your own.
+#if defined(SCHEDULER_CAS) && defined(SCHEDULER_LOAD_ACQUIRE) && defined(SCHEDULER_STORE_RELEASE) && defined(SCHEDULER_ATOMIC_ADD)
+  // Supplied by the sketch.
+#elif defined(__AVR__) || defined(ESP8266) || (defined(__ARM_ARCH_6M__) && !defined(ARDUINO_ARCH_RP2040))
+  #define SCHEDULER_LOAD_ACQUIRE(x)              ({ __typeof__(x) _sch_v; SCHEDULER_ENTER_CRITICAL(); _sch_v = (x); SCHEDULER_EXIT_CRITICAL(); _sch_v; })
+  #define SCHEDULER_STORE_RELEASE(x, v)          do { SCHEDULER_ENTER_CRITICAL(); (x) = (v); SCHEDULER_EXIT_CRITICAL(); } while (0)
+  #define SCHEDULER_ATOMIC_ADD(x, v)             do { SCHEDULER_ENTER_CRITICAL(); (x) += (v); SCHEDULER_EXIT_CRITICAL(); } while (0)
+  #define SCHEDULER_CAS(x, expected, desired)    ({ bool _sch_ok; SCHEDULER_ENTER_CRITICAL(); \
+                                                    _sch_ok = ((x) == (expected)); \
+                                                    if (_sch_ok) (x) = (desired); else (expected) = (x); \
+                                                    SCHEDULER_EXIT_CRITICAL(); _sch_ok; })
+#else
+  #define SCHEDULER_LOAD_ACQUIRE(x)              __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+  #define SCHEDULER_STORE_RELEASE(x, v)          __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+  #define SCHEDULER_ATOMIC_ADD(x, v)             __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+  #define SCHEDULER_CAS(x, expected, desired)    __atomic_compare_exchange_n(&(x), &(expected), (desired), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#endif
+
 
 // We need to def a few types... First, let's def a function pointer to avoid
 // cluttering things up with unreadable casts...
 
 typedef void (*FunctionPointer) ();
 
+// A callback shared by many schedules, called once with the contexts of all of them that are due. See Note 13.
+typedef void (*BatchFunctionPointer) (void** contexts, uint16_t count);
+
+// Called from the tick ISR when a running schedule overruns its watchdog budget. Keep it short.
+typedef void (*OverrunHook) (uint32_t pid, uint32_t ticks);
+
+// A small step of background work, run when nothing is due. Return true if there is more to do. See Note 15.
+typedef boolean (*IdleWorkPointer) (void* context);
+
+typedef struct sch_idle_work_t {
+  IdleWorkPointer callback;
+  void*    context;
+} IdleWork;
+
+// Receives each deferred log record once it has been formatted. See Note 16.
+typedef void (*LogOutput) (const char* line);
+
+// A sink for chunked dumps. See Note 17. The writer returns how many bytes it took. The optional
+//  available() returns how many bytes can be written right now without blocking (Serial.availableForWrite()).
+typedef size_t (*DumpWrite) (const char* buf, size_t len);
+typedef size_t (*DumpAvailable) (void);
+
+// What startDump() writes...
+#define SCHEDULER_DUMP_SCHEDULES   0x00   // As dumpScheduleData().
+#define SCHEDULER_DUMP_PROFILING   0x01   // As dumpProfilingData().
+
+// One-shot work handed to post(). See Note 20.
+typedef void (*PostedFunctionPointer) (void* context);
+
+typedef struct sch_posted_t {
+  PostedFunctionPointer callback;
+  void*    context;
+  volatile uint8_t sequence;   // The position this slot is free for, or that position + 1 once it is filled.
+} PostedWork;
+
+// Receives the PWM engine's outputs, one bit per channel, from the tick ISR. See Note 19. Keep it short.
+typedef void (*PwmOutput) (uint32_t mask);
+
+// The PWM engine. Duty cycles are stored bit-sliced: bit c of planes[b] is bit b of channel c's duty.
+typedef struct sch_pwm_t {
+  PwmOutput output;                         // NULL if the mask is only read with getPwmMask().
+  uint32_t  planes[SCHEDULER_PWM_MAX_BITS]; // Duty cycles in force for this period.
+  uint32_t  pending[SCHEDULER_PWM_MAX_BITS];  // Duty cycles that take over when the next period starts.
+  uint32_t  full;                           // Channels that are on for the whole period.
+  uint32_t  pending_full;
+  volatile uint32_t mask;                   // Current outputs.
+  uint16_t  phase;                          // Ticks into the current period.
+  uint8_t   bits;                           // The period is 2^bits ticks.
+  volatile boolean dirty;                   // Is there anything in pending?
+} PwmEngine;
+
+// A deferred log record, as it sits in the ring. Nothing in it has been formatted yet.
+typedef struct sch_log_record_t {
+  const char* format;          // The format string. Its address doubles as an id for host-side decoding.
+  uint32_t tick;               // elapsed ticks when the record was made.
+  uint32_t args[SCHEDULER_LOG_ARGS];  // Raw arguments, each passed to the format as an unsigned long.
+  volatile uint16_t sequence;  // The position this slot is free for, or that position + 1 once it is filled.
+} LogRecord;
+
 // Data associated with profiling schedules...
 typedef struct sch_item_prof_t {
+  volatile uint32_t sequence;  // Odd while the fields below are being written. See snapshotProfile().
   uint32_t last_time_micros;   // Last execution time, in microseconds.
   uint32_t worst_time_micros;  // Worst execution time, in microseconds.
   uint32_t best_time_micros;   // Best execution time, in microseconds.
   uint32_t execution_count;    // Number of times this schedule has executed.
+  uint32_t sample_count;       // Number of those executions that were timed. See Note 7.
+  uint16_t sample_rate;        // Time one run in this many. 1 times every run.
+  uint16_t sample_countdown;   // Runs left until the next one that is timed.
+  boolean  sample_random;      // Pick the timed runs pseudo-randomly, rather than every sample_rate'th.
+  uint32_t worst_lateness;     // Longest wait between firing and being dispatched, in ticks.
+  uint64_t total_time_micros;  // Sum of all execution times, in microseconds.
+  uint64_t total_lateness;     // Sum of all latenesses, in ticks.
+  uint32_t histogram[SCHEDULER_HISTOGRAM_BUCKETS];  // Execution times, in power-of-two buckets.
+  uint32_t lateness_histogram[SCHEDULER_LATENESS_BUCKETS];  // Latenesses, in power-of-two buckets.
+  uint32_t ewma_mean_x16;      // Moving average of execution time, in 1/16ths of a microsecond. See Note 6.
+  uint32_t ewma_variance;      // Moving variance of execution time, in square microseconds.
+  uint32_t baseline_mean_x16;  // ewma_mean_x16 when saveProfilingBaseline() was last called. Zero if never.
+  uint8_t  regression_runs;    // Number of consecutive runs that the average has been off the baseline.
   boolean  profiling_active;   // Is this data being actively refreshed?
 } ScheduleProfile;
 
+// A runtime anomaly, as seen by the profiler...
+typedef struct sch_anomaly_t {
+  uint32_t pid;                // The schedule.
+  uint32_t timestamp;          // micros() at the end of the run that tripped the detector.
+  uint32_t observed;           // The run's execution time (outliers) or the moving average (regressions), in microseconds.
+  uint32_t expected;           // The moving average (outliers) or the baseline (regressions), in microseconds.
+  uint8_t  kind;               // One of the SCHEDULER_ANOMALY_* values.
+} ScheduleAnomaly;
+
+// One row of the result of getTopSchedules()...
+typedef struct sch_rank_t {
+  uint32_t pid;                // The schedule.
+  uint32_t value;              // The metric it was ranked by. See the SCHEDULER_RANK_* values.
+} ScheduleRank;
+
+// A consistent copy of the scheduler's loop counters. See snapshotStats()...
+typedef struct sch_stats_t {
+  uint32_t productive_loops;   // Number of calls to serviceScheduledEvents() that actually called a schedule.
+  uint32_t total_loops;        // Number of calls to serviceScheduledEvents().
+  uint32_t overhead;           // The time in microseconds required to service the last schedule loop.
+} SchedulerStats;
+
+// Optional per-schedule parameters. Only allocated once one of them is set...
+typedef struct sch_item_params_t {
+  uint32_t exec_estimate_micros;  // Declared execution time. Zero means "use the profiler's worst case".
+  uint32_t watchdog_ticks;        // How many ticks a single run may take before it is an overrun. Zero is off.
+  const char* name;               // Name given by the user, for reports. Not copied. NULL if none.
+  uint16_t priority;              // Base priority under SCHEDULER_POLICY_AGING. Higher runs first.
+  uint16_t aging_rate;            // Priority gained per tick spent waiting to be dispatched.
+  uint16_t weight;                // Share of the CPU under SCHEDULER_POLICY_FAIR_SHARE, relative to the others.
+  uint64_t fair_micros;           // CPU time used under SCHEDULER_POLICY_FAIR_SHARE, in microseconds.
+  uint8_t  degrade_action;        // One of the SCHEDULER_DEGRADE_* values. See Note 10.
+  uint8_t  stretch_factor;        // SCHEDULER_DEGRADE_STRETCH only. What the period is multiplied by.
+  uint16_t utility;               // Value of one run, for load shedding. Zero never sheds. See Note 11.
+  uint32_t shed_cost;             // Execution estimate (us) taken when the pending release was queued.
+  uint32_t shed_count;            // Number of releases shed.
+  BatchFunctionPointer batch_callback;  // Batch schedules only. Used instead of schedule_callback. See Note 13.
+  void*    context;               // Batch schedules only. Handed to batch_callback.
+  uint8_t  trigger_mode;          // One of the SCHEDULER_TRIGGER_* values. See Note 18.
+  uint8_t  trigger_burst;         // SCHEDULER_TRIGGER_BUCKET only. Most tokens the bucket holds.
+  volatile uint8_t  trigger_tokens;   // SCHEDULER_TRIGGER_BUCKET only. Tokens in the bucket as of trigger_mark.
+  uint32_t trigger_window;        // Debounce quiet time, throttle window, or bucket refill interval, in ticks.
+  volatile uint32_t trigger_mark;     // Tick of the last throttled release, or of the last bucket refill.
+  volatile uint32_t trigger_drops;    // Triggers dropped by the throttle or bucket.
+} ScheduleParams;
+
+// A budget overrun, as seen by the watchdog...
+typedef struct sch_overrun_t {
+  uint32_t pid;                   // The schedule that overran.
+  uint32_t ticks;                 // How long it ran. Final if the run has since finished, otherwise a lower bound.
+  uint32_t detected_at;           // The tick at which the overrun was noticed.
+} ScheduleOverrun;
+
 // Type for schedule items...
 typedef struct sch_item_t {
   struct sch_item_t* next;             // This will be a linked-list.
+  struct sch_item_t* pid_next;         // Chain within a bucket of the PID index.
+  struct sch_item_t* wheel_next;       // Timeout schedules only. Chain within a timing wheel slot.
+  struct sch_item_t* wheel_prev;       // Timeout schedules only.
+  struct sch_item_t* tick_next;        // Chain of enabled schedules that advanceScheduler() counts down.
+  struct sch_item_t* tick_prev;
   struct sch_item_prof_t* prof_data;   // If this schedule is being profiled, the ref will be here.
+  struct sch_item_budget_t* budget_data;  // If this schedule runs on a CPU budget, the ref will be here. See Note 4.
+  struct sch_item_params_t* params;    // Optional parameters. NULL until one is set.
   uint32_t pid;                        // The process ID of this item. Zero is invalid.
   uint32_t thread_time_to_wait;        // How much longer until the schedule fires?
+  uint32_t thread_deadline;            // Timeouts, and periodic schedules with absolute deadlines. The scheduleClock() tick at which the schedule fires.
   uint32_t thread_period;              // How often does this schedule execute?
+  uint32_t release_tick;               // The tick at which thread_fire was last set.
+  uint32_t max_wait_ticks;             // Longest wait between release and dispatch seen so far.
+  uint32_t vruntime;                   // Virtual runtime under SCHEDULER_POLICY_FAIR_SHARE. Wraps. See Note 9.
+  uint16_t ready_pos;                  // 1-based position in the ready heap. Zero if not in it.
+  uint16_t shed_pos;                   // 1-based position in the shed heap. Zero if not in it. See Note 11.
+  uint8_t  criticality;                // Criticality level. Zero is the lowest. See Note 10.
   int16_t  thread_recurs;              // See Note 2.
+  uint8_t  thread_mode;                // One of the SCHEDULE_MODE_* values.
+  uint8_t  wheel_slot;                 // Timeout schedules only. The wheel slot this item is linked into.
+  boolean  in_wheel;                   // Timeout schedules only. Is this item linked into the wheel?
+  boolean  in_tick_list;               // Is this item linked into the tick list?
   boolean  thread_enabled;             // Is the schedule running?
   boolean  thread_fire;                // Is the schedule to be executed?
   boolean  autoclear;                  // If true, this schedule will be removed after its last execution.
   FunctionPointer schedule_callback;   // Pointers to the schedule service function.
 } ScheduleItem;
 
+// Orders that a ScheduleHeap can keep...
+#define SCHEDULER_HEAP_VRUNTIME  0x00   // Smallest virtual runtime on top. See Note 9.
+#define SCHEDULER_HEAP_DENSITY   0x01   // Least utility per microsecond on top. See Note 11.
+
+// A binary min-heap of schedules. Each schedule keeps its position in the heap, so it can be taken out of the middle.
+typedef struct sch_heap_t {
+  ScheduleItem** items;                // The heap. NULL if not in use.
+  uint16_t count;                      // Number of entries in items.
+  uint16_t size;                       // Capacity of items.
+  uint8_t  order;                      // One of the SCHEDULER_HEAP_* values.
+} ScheduleHeap;
+
+// A dump that is being written out a row at a time. See Note 17.
+typedef struct sch_dump_job_t {
+  DumpWrite     write;
+  DumpAvailable available;             // NULL if the sink never blocks.
+  ScheduleItem* cursor;                // The next schedule to consider. Moved on if it is destroyed.
+  uint32_t pid;                        // Only this schedule. Zero for all of them.
+  uint8_t  kind;                       // One of the SCHEDULER_DUMP_* values.
+  uint8_t  stage;                      // Header, rows, trailer, or done.
+  uint8_t  line_len;                   // Length of the row in line.
+  uint8_t  line_pos;                   // How much of it has been written.
+  char     line[SCHEDULER_DUMP_LINE];  // The row being written.
+} DumpJob;
+
 
 
 /**  Note 2:
@@ -77,14 +444,314 @@ typedef struct sch_item_t {
 *  If the value is anything else, the schedule remains enabled and this value is decremented.
 */
 
+/**  Note 3:
+* Timeout schedules are meant for watchdogs and the like, which are almost always re-armed
+*  (with delaySchedule()) or disabled before they fire. Rather than counting down on every tick,
+*  they hold an absolute deadline and sit in a timing wheel. Re-arming only rewrites the deadline;
+*  the entry is left where it is, and is moved (or dropped, if disabled) when its slot comes up.
+*  A timeout that fires is disabled (or reaped, if auto_clear) after it runs, until re-armed.
+*/
+
+/**  Note 4:
+* A budgeted schedule is given budget_micros of CPU time every thread_period ticks. It is only
+*  dispatched while it has some of that budget left, and the time it takes is charged against it.
+*  If a dispatch overruns the budget, the debt is carried into the next period. This is what lets
+*  a child Scheduler run as a task of its parent without being able to steal the parent's time.
+*
+* Servers are budgeted schedules that run queued aperiodic jobs (one per dispatch) instead of a child.
+*  A deferrable server has its budget topped up to full every period. A sporadic server gets back
+*  each chunk of budget it spends one period after it spent it. Either way, a server never uses more
+*  than budget_micros in any window of thread_period ticks, so for the purposes of schedulability it
+*  looks exactly like a periodic schedule with that period and execution time.
+*/
+
+/**  Note 5:
+* When admission control is on, every schedule is charged a utilisation of C/T, where T is its
+*  period (converted with setTickPeriod()) and C is its declared execution time, or its budget if
+*  it is budgeted, or the profiler's worst case if nothing was declared. Disabled schedules are
+*  charged too, since they may be enabled at any time. Creating a schedule, changing its period or
+*  changing its execution time fails if the total would exceed the bound: n(2^(1/n) - 1) for
+*  SCHEDULER_ADMIT_RM, 100% for SCHEDULER_ADMIT_EDF, or the configured bound, whichever is lower.
+*  Only schedules with a nonzero utilisation count towards n, so timeouts, triggered schedules and
+*  others with no known execution time don't tighten the bound.
+*  Utilisation is given in parts-per-million throughout.
+*/
+
+/**  Note 6:
+* Every profiled run updates an exponentially-weighted moving average and variance of the execution
+*  time (weight 1/16, integer arithmetic only). Once a schedule has run 16 times, a run that is more
+*  than k standard deviations (and more than floor_micros) away from the average is logged as an
+*  outlier. The comparison is done on squares, so no square root is taken. If a baseline has been
+*  saved, an average that stays more than shift_percent away from it for SCHEDULER_REGRESSION_RUNS
+*  runs in a row is logged as a regression (once, until it comes back).
+*/
+
+/**  Note 7:
+* A profiled schedule may be sampled, so that only one run in sample_rate is timed. Every run is
+*  still counted in execution_count, but the times, histograms and anomaly detection only see the
+*  sample_count runs that were timed. Totals derived from them (CPU share, for instance) are scaled
+*  up by execution_count / sample_count. With random sampling, the gap between timed runs is drawn
+*  uniformly from [1, 2 * sample_rate - 1], which avoids aliasing with periodic behaviour.
+*/
+
+/**  Note 8:
+* Under SCHEDULER_POLICY_LIST_ORDER, the due schedule nearest the head of the list always goes
+*  first, so a busy schedule near the head can starve the tail indefinitely. Under
+*  SCHEDULER_POLICY_AGING, each due schedule's effective priority is its base priority plus its
+*  aging rate times the number of ticks it has been waiting, and the highest goes first (list order
+*  breaks ties). A schedule with a non-zero rate waits at most about (P - p) / rate ticks behind
+*  anything of base priority P. Schedules that were never given a priority have priority 0 and
+*  rate SCHEDULER_DEFAULT_AGING_RATE. The longest wait of every schedule is kept either way.
+*/
+
+/**  Note 9:
+* Under SCHEDULER_POLICY_FAIR_SHARE, every dispatch is timed and the schedule's virtual runtime is
+*  advanced by the time it took, scaled by SCHEDULER_DEFAULT_WEIGHT / weight. The due schedule with the
+*  smallest virtual runtime goes next, so over time each busy schedule gets CPU in proportion to its
+*  weight. Due schedules are kept in a binary heap, so release and dispatch are O(log n). A schedule
+*  that becomes due after sleeping starts no further back than the last dispatched one, so it can't
+*  bank credit while idle. Entries whose release was cancelled are dropped lazily when they reach the top.
+*  Dispatch never allocates. A schedule's achieved share is kept in its parameters, which every schedule
+*  gets when fair share is chosen. One created afterwards is dispatched at the default weight, but its
+*  share is only recorded once it has parameters (setScheduleWeight() gives it some).
+*/
+
+/**  Note 10:
+* Every schedule has a criticality level (zero by default), and the scheduler has a mode, which starts
+*  at zero. Schedules whose level is below the mode are degraded: suspended, or run at a stretched
+*  period. The mode is raised to a schedule's level when that schedule (being at or above the mode, and
+*  above zero) runs for longer than its declared execution time (setExecutionEstimate()), or is
+*  dispatched more than the lateness threshold after its release. Each such event also restarts the
+*  recovery timer. Once recovery_ticks pass without one, the mode drops by one level (and the timer
+*  restarts), so the system steps back down only after it has been quiet for a while.
+*  Changing mode only writes the mode; each schedule checks its level against it when it is next
+*  released or dispatched, so a mode change costs the same however many schedules there are.
+*/
+
+/**  Note 11:
+* Schedules that have been given a utility take part in load shedding. When one of them is released,
+*  it is queued by utility density (utility over its execution estimate), and the estimate is added to
+*  the backlog. Before each service pass, if the backlog is over the limit, the pending release with
+*  the least utility per microsecond is dropped, so that what the CPU does get to is the most valuable
+*  work. At most one release is shed per pass, which is O(log n). Schedules without a utility are never
+*  shed, and their cost is not counted in the backlog.
+*/
+
+/**  Note 12:
+* buildCyclicSchedule() turns the enabled, forever-recurring periodic schedules into a static table.
+*  Every such schedule must have an execution estimate (declared, or the profiler's worst case). If
+*  asked, periods are first snapped down to a harmonic chain (the shortest period times a power of
+*  two), which keeps the table small. The minor frame is the GCD of the periods, and the major frame
+*  (hyperperiod) is their LCM. Schedules are placed in rate-monotonic order (list order breaking
+*  ties), each job in the first minor frame between its release and its deadline that has room for
+*  it, a frame holding one tick's worth of microseconds (see setTickPeriod()).
+*  While the table is running, advanceScheduler() only counts ticks and frames, and
+*  serviceScheduledEvents() runs the next job listed for the current frame. Nothing else is released:
+*  not timeouts, budgeted schedules, or schedules left out of the table. Jobs still unrun when their
+*  frame ends are skipped, and the frame is counted as an overrun. The table is a snapshot: rebuild it after changing
+*  schedules. Removing a schedule that is in it stops the table.
+*/
+
+/**  Note 13:
+* A batch schedule has a BatchFunctionPointer and a context instead of a plain callback. When one is
+*  dispatched, every other due batch schedule with the same callback (up to SCHEDULER_BATCH_MAX in all,
+*  in list order) is dispatched with it, and the callback is called once with all of their contexts.
+*  Each of them is then treated as having run: its release is cleared and its recurrence counted. The
+*  run is timed once, and each schedule is charged an equal share of it. The cyclic executive does not
+*  batch.
+*/
+
+/**  Note 14:
+* Besides the main list, enabled periodic and budgeted schedules are chained into a tick list, and
+*  advanceScheduler() walks only that. Disabled schedules and timeouts cost nothing per tick. The counts
+*  behind getTotalSchedules(), getActiveSchedules() and getPendingSchedules() are kept as schedules change,
+*  so those are O(1). The pending count is the difference of two counters, each written from one side
+*  only (releases from the ISR, clears from the main loop). Neither side has to lock out the other.
+*/
+
+/**  Note 15:
+* Background work is a queue of small steps (a checksum over the next block, one log record flushed)
+*  that serviceScheduledEvents() runs in passes where no schedule was due. Each returns true while it has
+*  more to do, and is dropped from the queue when it returns false. The queue is taken round-robin, and a
+*  pass keeps going until the idle budget (measured from the start of the pass) is used up, every item has
+*  had a turn, or a schedule comes due. The default budget of zero runs one step per idle pass. Work is
+*  only ever added, removed and run from the main loop.
+*/
+
+/**  Note 16:
+* The deferred logger lets callbacks (and ISRs) record a format string and a few raw arguments in a
+*  handful of cycles, leaving the formatting and output to idle time. The ring works like the post()
+*  ring in Note 20: a writer claims a slot by compare-and-swap on the head, fills it, and marks it ready
+*  through the slot's sequence number. So logEvent() is lock-free, and safe from ISRs and from other
+*  cores or threads. The reader takes records in order, and stops at the first one that isn't ready yet.
+*  When the ring is full new records are dropped and counted, so the reader never sees a slot being
+*  overwritten. Records are either formatted ("tick: message") and handed to the output by flushLog(),
+*  which beginLogging() queues as background work, or copied out raw by readLog() for decoding
+*  elsewhere. Each argument is passed to the format as an unsigned long, so use %lu, %ld or %lx.
+*/
+
+/**  Note 17:
+* startDump() writes a dump to a sink without ever waiting on it. Each service pass formats at most one
+*  row, and writes only as much of it as the sink says it can take. The rest waits for a later pass. Rows
+*  are formatted as the dump reaches them, so a long dump shows each schedule as it was when its row was
+*  written, not one consistent snapshot. Removing a schedule while it is being dumped is safe.
+*/
+
+/**  Note 18:
+* triggerSchedule() is for event-driven schedules, and is safe to call from an ISR. What a trigger does
+*  depends on the schedule's trigger mode. A debounced trigger re-arms the schedule window ticks out,
+*  using the timing wheel for timeouts (see Note 3) and the countdown for periodic schedules. A throttle
+*  remembers when it last released. A token bucket works out its refill from the ticks since the last
+*  one. So a trigger costs the same however fast they come, and none of them adds work to the tick. A
+*  trigger that arrives while the schedule is already waiting to run is absorbed into that run. It costs
+*  no token and is not counted as a drop. Triggers on disabled schedules are ignored.
+*  createTriggeredSchedule() makes a schedule that only runs when triggered.
+*/
+
+/**  Note 19:
+* The PWM engine drives up to 32 software PWM channels from advanceScheduler(), without a schedule per
+*  edge. Every channel shares a period of 2^bits ticks, and a channel with duty d is on for the first d
+*  ticks of it. The duty cycles are kept bit-sliced (one word per bit of resolution, one bit per channel).
+*  So each tick compares the phase against all of the channels at once, in bits word operations, however
+*  many channels there are. Duty cycles set with setPwmDuty() take effect when the next period starts, as
+*  with buffered hardware compare registers, so a period is never cut short or stretched. The output
+*  hook is called from the ISR whenever the mask changes.
+*/
+
+/**  Note 20:
+* post() runs a function once, as soon as possible, without a schedule. There is no PID, no timer state
+*  and no allocation. The work goes into a fixed ring, and the next serviceScheduledEvents() pass runs
+*  everything that was posted before the pass began, ahead of any schedule. Work posted by posted work
+*  waits for the pass after. The ring's head and tail are positions that count up (wrapping at 256), and
+*  each slot keeps the position it is free for. A poster claims a slot by compare-and-swap on the head,
+*  fills it, and then marks it ready by storing position + 1 (with release ordering). Running it frees the
+*  slot for the next lap. The pass stops at the first slot that isn't ready yet. Because a slot's state
+*  carries its lap, a poster that stalls while others go all the way round the ring can't claim a slot
+*  that is still in use. So post() is lock-free, and safe from ISRs and from other cores or threads.
+*  Returns false if the ring is full.
+*/
+
+/**  Note 21:
+* Deadlines are kept against a schedule clock: elapsed_ticks less an epoch offset. While the scheduler
+*  is paused, each tick adds one to the offset, so the schedule clock (and with it every deadline,
+*  timeout and frame) stands still. The watchdog and the PWM engine keep running. shiftAll() adds to the
+*  offset directly, which pushes every deadline back by the same amount and leaves relative phases as
+*  they were. Both are O(1) for timeouts, which always have absolute deadlines. Periodic schedules count
+*  down by default. Pausing stops their countdowns too, but shifting them means visiting each one. After
+*  setDeadlineMode(true) they keep absolute deadlines, and shiftAll() is O(1) for everything. Both modes
+*  release a schedule at the same ticks. Budgeted schedules always count down.
+*/
+
 
 #ifdef __cplusplus
 
+class Scheduler;
+struct sch_metrics_sink_t;
+
+// Data associated with budgeted schedules...
+typedef struct sch_item_budget_t {
+  Scheduler* child;             // The child scheduler that this schedule dispatches. NULL for servers.
+  int32_t  remaining_micros;    // CPU time left in this period. Negative if the last dispatch overran.
+  uint32_t budget_micros;       // CPU time granted every period.
+  uint32_t exhausted_count;     // Number of dispatches that used up the budget.
+  FunctionPointer* job_queue;   // Servers only. Ring of pending aperiodic jobs.
+  volatile uint8_t job_head;    // Servers only. Index of the next job to run.
+  volatile uint8_t job_tail;    // Servers only. Index of the next free slot.
+  uint8_t  job_slots;           // Servers only. Length of job_queue. One slot is always left empty.
+  boolean  sporadic;            // Servers only. Sporadic (true) or deferrable (false) replenishment.
+  uint8_t  refill_head;         // Sporadic only. Index of the oldest pending replenishment.
+  uint8_t  refill_count;        // Sporadic only. Number of pending replenishments.
+  uint32_t refill_tick[SCHEDULER_SPORADIC_REFILLS];    // Sporadic only. When each replenishment is due.
+  int32_t  refill_micros[SCHEDULER_SPORADIC_REFILLS];  // Sporadic only. How much each one gives back.
+} ScheduleBudget;
+
+
 // This is the only version I've tested...
 class Scheduler {
   uint32_t next_pid;                       // Next PID to assign.
   ScheduleItem* schedule_root_node;        // The root of the linked lists in this scheduler.
-  uint32_t currently_executing;	           // Hold PID of currently-executing Schedule. 0 if none.
+  volatile uint32_t currently_executing;  // Hold PID of currently-executing Schedule. 0 if none.
+  ScheduleItem** running_batch;            // The other schedules in the batch being run. See Note 13.
+  uint16_t running_batch_count;            // Number of entries in running_batch. 0 if no batch is running.
+  uint32_t elapsed_ticks;                  // Number of calls to advanceScheduler().
+  volatile uint32_t epoch_offset;          // elapsed_ticks less the schedule clock. See Note 21.
+  volatile boolean  paused;                // Is the schedule clock stopped?
+  boolean  absolute_deadlines;             // Do periodic schedules keep absolute deadlines instead of countdowns?
+  ScheduleItem** pid_index;                // Hash buckets of schedules, keyed by PID.
+  uint16_t pid_index_size;                 // Number of buckets in pid_index. Always a power of two.
+  uint16_t schedule_count;                 // Number of schedules in the list.
+  uint16_t active_count;                   // Number of those that are enabled.
+  ScheduleItem* tick_head;                 // Enabled periodic and budgeted schedules. The only ones advanceScheduler() visits.
+  volatile uint16_t released_total;        // Releases so far. Wraps. Only ever increased with the ISR unable to interfere.
+  uint16_t cleared_total;                  // Releases cleared so far (run, dropped or cancelled). Wraps. Main loop only.
+  ScheduleItem* timeout_wheel[SCHEDULER_WHEEL_SLOTS];  // Timeout schedules, bucketed by deadline.
+  uint32_t tick_micros;                    // Length of a tick in microseconds. Only used for utilisation.
+  uint32_t admission_bound;                // Configured utilisation bound (ppm). 0 for the policy's own.
+  uint8_t  admission_policy;               // One of the SCHEDULER_ADMIT_* values.
+  uint8_t  dispatch_policy;                // One of the SCHEDULER_POLICY_* values.
+  ScheduleHeap ready_heap;                 // Fair share only. Due schedules, by virtual runtime.
+  uint32_t min_vruntime;                   // Virtual runtime of the last fair-share dispatch. Never goes back.
+  uint64_t fair_total_micros;              // CPU time used by all schedules under fair share, in microseconds.
+  ScheduleHeap shed_heap;                  // Load shedding only. Pending sheddable releases, by utility density.
+  volatile uint32_t shed_backlog;          // Sum of shed_cost over shed_heap, in microseconds.
+  uint32_t shed_limit_micros;              // Backlog above which releases are shed. Zero turns shedding off.
+  uint32_t shed_total;                     // Number of releases shed, over all schedules.
+  ScheduleItem** cyclic_jobs;              // The jobs of the cyclic table, frame by frame. NULL if none. See Note 12.
+  uint16_t* cyclic_frame_start;            // Index into cyclic_jobs of the first job of each frame. One extra at the end.
+  uint16_t cyclic_frames;                  // Number of minor frames in the major frame.
+  uint32_t cyclic_minor;                   // Length of a minor frame, in ticks.
+  volatile uint32_t cyclic_tick;           // Ticks into the current minor frame.
+  volatile uint32_t cyclic_frame_count;    // Minor frames started since the table was built. Wraps.
+  volatile uint32_t cyclic_frame_tick;     // The tick at which the current minor frame started.
+  uint32_t cyclic_cursor_frame;            // The frame that serviceScheduledEvents() is working through.
+  uint16_t cyclic_cursor_job;              // How many of that frame's jobs have been run.
+  uint32_t cyclic_overruns;                // Frames that ended before all of their jobs were run.
+  volatile uint8_t  crit_mode;             // Current criticality mode. See Note 10.
+  volatile uint32_t crit_last_trigger;     // The tick of the last overrun or lateness that held up the mode.
+  uint32_t crit_lateness_ticks;            // Lateness that raises the mode. Zero turns the lateness trigger off.
+  uint32_t crit_recovery_ticks;            // Quiet ticks before the mode steps down. Zero never steps down.
+  volatile uint32_t crit_switch_count;     // Number of mode changes, up or down.
+
+  volatile boolean  watchdog_armed;        // Does the running schedule have a watchdog budget?
+  volatile uint32_t watchdog_started;      // The tick at which the running schedule was dispatched.
+  volatile uint32_t watchdog_deadline;     // The tick at which the running schedule overruns.
+  volatile int8_t   watchdog_open;         // Index of the overrun being recorded for the running schedule. -1 if none.
+  OverrunHook overrun_hook;                // Called from the ISR on overrun. NULL if none.
+  uint32_t overrun_count;                  // Total number of overruns seen.
+  uint8_t  overrun_next;                   // Next slot to write in overrun_log.
+  ScheduleOverrun overrun_log[SCHEDULER_OVERRUN_LOG];  // The most recent overruns.
+
+  uint32_t sample_seed;                    // State of the xorshift generator used for random sampling.
+  uint32_t profiler_overhead;              // Measured cost (us) of timing an empty callback. Subtracted from every sample.
+  uint32_t profiler_resolution;            // Smallest step (us) seen in micros(). Zero until calibrated.
+  boolean  profiler_calibrated;            // Has calibrateProfiler() been run?
+  uint8_t  profiler_calibration_tries;     // Failed calibrations so far. See SCHEDULER_CALIBRATION_TRIES.
+  uint8_t  anomaly_sigmas;                 // k for outlier detection. Zero turns anomaly detection off.
+  uint8_t  anomaly_shift_percent;          // How far the average may drift from its baseline. Zero ignores baselines.
+  uint32_t anomaly_floor_micros;           // Outliers must also be at least this far from the average.
+  uint32_t anomaly_count;                  // Total number of anomalies seen.
+  uint8_t  anomaly_next;                   // Next slot to write in anomaly_log.
+  ScheduleAnomaly anomaly_log[SCHEDULER_ANOMALY_LOG];  // The most recent anomalies.
+
+  IdleWork idle_work[SCHEDULER_IDLE_SLOTS];  // Background work, in round-robin order. See Note 15.
+  uint8_t  idle_count;                     // Number of items in idle_work.
+  uint8_t  idle_cursor;                    // The item that gets the next turn.
+  uint32_t idle_budget_micros;             // How long an idle pass may spend on background work.
+  uint32_t idle_runs;                      // Steps of background work run so far.
+
+  LogRecord* log_ring;                     // Deferred log records. NULL unless logging. See Note 16.
+  uint16_t log_slots;                      // Length of log_ring. A power of two.
+  volatile uint16_t log_head;              // Position of the next slot to be claimed by a writer. Wraps at 65536.
+  uint16_t log_tail;                       // Position of the next slot to be read.
+  LogOutput log_output;                    // Where flushLog() sends formatted records. May be NULL.
+  volatile uint32_t log_dropped;           // Records dropped because the ring was full.
+
+  DumpJob* dump_job;                       // The dump being written. NULL if none. See Note 17.
+  PwmEngine* pwm;                          // NULL unless the PWM engine is running. See Note 19.
+
+  PostedWork post_ring[SCHEDULER_POST_SLOTS];  // Work waiting for the next pass. See Note 20.
+  volatile uint8_t post_head;              // Position of the next slot to be claimed by post(). Wraps at 256.
+  uint8_t  post_tail;                      // Position of the next slot to be run.
   
   public:
     Scheduler();   // Constructor
@@ -96,15 +763,56 @@ class Scheduler {
     uint32_t productive_loops;  // Number of calls to serviceScheduledEvents() that actually called a schedule.
     uint32_t total_loops;       // Number of calls to serviceScheduledEvents().
     uint32_t overhead;          // The time in microseconds required to service the last empty schedule loop.
+    volatile uint32_t stats_sequence;  // Odd while the three fields above are being written.
+
+    /* Copy out a consistent set of counters, even if serviceScheduledEvents() is running on another
+     *   thread (or was interrupted mid-update by the caller's ISR). Writers never wait. Returns false
+     *   if no consistent copy could be had after SCHEDULER_SNAPSHOT_RETRIES tries.
+     */
+    boolean snapshotStats(SchedulerStats* out);
+    boolean snapshotProfile(uint32_t g_pid, ScheduleProfile* out);
+
+    /* Fills out with up to max_count profiled schedules that rank highest by the given SCHEDULER_RANK_*
+     *   metric, highest first. Returns how many were written. O(n log k), and does no string formatting.
+     */
+    uint8_t getTopSchedules(ScheduleRank* out, uint8_t max_count, uint8_t metric);
+
+    /* Runtime anomaly detection for profiled schedules. See Note 6. */
+    void     setAnomalyDetection(uint8_t sigmas, uint8_t shift_percent, uint32_t floor_micros);
+    void     saveProfilingBaseline(uint32_t g_pid);         // Pass 0 to save a baseline for every profiled schedule.
+    uint32_t getAnomalyCount(void);
+    uint8_t  getAnomalies(ScheduleAnomaly* out, uint8_t max_events);  // Copies out the latest, oldest first.
+
+    boolean setScheduleName(uint32_t g_pid, const char* name);  // The string is not copied, so it must outlive the schedule.
+
+    /* Renders the scheduler's counters, utilisation, and each profiled schedule's execution-time and lateness
+     *   histograms in OpenMetrics (Prometheus) text format. Nothing is allocated.
+     *   The buffer version behaves like snprintf(): it returns the full length of the output, and writes as
+     *   much of it as will fit (always NUL-terminated). The file-descriptor version returns false on a write error.
+     */
+    size_t exportMetrics(char* buf, size_t len);
+    #if defined(SCHEDULER_HAS_FILE_DESCRIPTORS)
+    boolean exportMetrics(int fd);
+    #endif
 
     uint16_t getTotalSchedules(void);   // How many total schedules are present?
     uint16_t getActiveSchedules(void);  // How many active schedules are present?
+    uint16_t getPendingSchedules(void); // How many schedules have fired, and are waiting to be serviced?
     uint32_t peekNextPID(void);         // Discover the next PID without actually incrementing it.
     
     boolean scheduleBeingProfiled(uint32_t g_pid);
     void beginProfiling(uint32_t g_pid);
     void stopProfiling(uint32_t g_pid);
     void clearProfilingData(uint32_t g_pid);        // Clears profiling data associated with the given schedule.
+    boolean setProfilingSampleRate(uint32_t g_pid, uint16_t rate, boolean random);  // Time one run in rate. See Note 7.
+
+    /* Measures how long the profiler takes to time an empty callback on this board and clock, and from then
+     *   on subtracts that from every sample. Runs by itself the first time profiling is begun, but may be
+     *   called again (from setup(), say, once the clock is running). Takes a few hundred microseconds.
+     */
+    void     calibrateProfiler(void);
+    uint32_t getProfilerOverhead(void);     // In microseconds.
+    uint32_t getProfilerResolution(void);   // Smallest step of micros(), in microseconds.
     
     // Alters an existing schedule (if PID is found),
     boolean alterSchedule(uint32_t schedule_index, uint32_t sch_period, int16_t recurrence, boolean auto_clear, FunctionPointer sch_callback);
@@ -122,6 +830,74 @@ class Scheduler {
      * sch_callback    The service function. Must be a pointer to a (void fxn(void)).
      */    
     uint32_t createSchedule(uint32_t sch_period, int16_t recurrence, boolean auto_clear, FunctionPointer sch_callback);
+    uint32_t createSchedule(uint32_t sch_period, int16_t recurrence, boolean auto_clear, FunctionPointer sch_callback, uint32_t exec_estimate_micros);
+
+    /* Add a new batch schedule. Returns the PID. If zero is returned, function failed. See Note 13.
+     *   As createSchedule(), but schedules that share batch_callback are run together when they are due
+     *   at the same time, with batch_callback being handed each of their contexts.
+     */
+    uint32_t createBatchSchedule(uint32_t sch_period, int16_t recurrence, boolean auto_clear, BatchFunctionPointer batch_callback, void* context);
+
+    /* Add a new timeout schedule, armed immediately. Returns the PID. If zero is returned, function failed.
+     *   The callback fires once if the schedule is not re-armed (delaySchedule()) or disabled within
+     *   timeout ticks. See Note 3.
+     */
+    uint32_t createTimeout(uint32_t timeout, boolean auto_clear, FunctionPointer sch_callback);
+
+    /* Add another Scheduler as a task of this one. Returns the PID. If zero is returned, function failed.
+     *   The child is advanced by our advanceScheduler(), and is dispatched (one of its schedules per
+     *   service pass) only while it has budget left. Do not drive the child from anywhere else.
+     *
+     * Parameters:
+     * child              The Scheduler to run.
+     * budget_micros      How much CPU time the child may use per replenishment period.
+     * replenish_period   How often (in ticks) the budget is topped up.
+     */
+    uint32_t createChildSchedule(Scheduler* child, uint32_t budget_micros, uint32_t replenish_period);
+    int32_t  getRemainingBudget(uint32_t g_pid);    // CPU time (microseconds) left this period. 0 if not budgeted.
+
+    /* Add a server for aperiodic jobs. Returns the PID. If zero is returned, function failed. See Note 4.
+     *
+     * Parameters:
+     * sch_period      The replenishment period of the server, in ticks.
+     * budget_micros   How much CPU time the server's jobs may use per period.
+     * queue_length    How many jobs may be waiting at once.
+     * sporadic        Sporadic (true) or deferrable (false) replenishment.
+     */
+    uint32_t createServer(uint32_t sch_period, uint32_t budget_micros, uint8_t queue_length, boolean sporadic);
+    boolean submitJob(uint32_t server_pid, FunctionPointer job);   // Queue a job. False if the queue is full. ISR-safe.
+
+    /* Event-driven schedules. See Note 18.
+     *   createTriggeredSchedule() returns the PID of a schedule that runs only when triggered, or 0 on failure.
+     *   setTriggerMode() may be used on any schedule. window is in ticks. burst is for SCHEDULER_TRIGGER_BUCKET.
+     */
+    uint32_t createTriggeredSchedule(uint8_t mode, uint32_t window, uint8_t burst, FunctionPointer sch_callback);
+    boolean  setTriggerMode(uint32_t g_pid, uint8_t mode, uint32_t window, uint8_t burst);
+    boolean  triggerSchedule(uint32_t g_pid);               // False if dropped, disabled or not found. ISR-safe.
+    uint32_t getTriggerDrops(uint32_t g_pid);
+
+    /* Pausing and shifting time. See Note 21. */
+    void     pause(void);                                   // Stops every schedule's clock. O(1).
+    void     resume(void);
+    boolean  isPaused(void);
+    void     shiftAll(uint32_t ticks);                      // Pushes every deadline back by ticks.
+    void     setDeadlineMode(boolean absolute);             // Absolute deadlines make shiftAll() O(1) for periodic schedules too.
+    uint32_t scheduleClock(void);                           // elapsed ticks, less time spent paused or shifted.
+
+    /* Immediate one-shot work. Runs at the start of the next service pass. False if the queue is full.
+     *   Lock-free. Safe from ISRs and other threads. See Note 20.
+     */
+    boolean  post(PostedFunctionPointer callback, void* context);
+    uint8_t  getPostBacklog(void);                          // Posted work not yet run.
+
+    /* Software PWM engine. See Note 19.
+     *   beginPwm() starts it with a period of 2^bits ticks (1 to SCHEDULER_PWM_MAX_BITS). Returns false if
+     *   bits is out of range or there wasn't memory. A duty of 2^bits or more is fully on.
+     */
+    boolean  beginPwm(uint8_t bits, PwmOutput output);
+    void     stopPwm(void);
+    boolean  setPwmDuty(uint8_t channel, uint16_t duty);    // Channel 0 to 31. Takes effect next period.
+    uint32_t getPwmMask(void);
     
     boolean scheduleEnabled(uint32_t g_pid);   // Is the given schedule presently enabled?
 
@@ -133,6 +909,72 @@ class Scheduler {
     
     boolean willRunAgain(uint32_t g_pid);                  // Returns true if the indicated schedule will fire again.
 
+    /* Admission control. See Note 5. */
+    void     setTickPeriod(uint32_t micros);                // How long is a tick? Defaults to 1000us.
+    void     setAdmissionControl(uint8_t policy, uint32_t bound_ppm);  // bound_ppm of 0 uses the policy's bound.
+    boolean  setExecutionEstimate(uint32_t g_pid, uint32_t micros);    // False if not found or not admitted.
+    uint32_t getUtilisation(void);                          // Total utilisation of all schedules, in ppm.
+    int32_t  getUtilisationHeadroom(void);                  // Bound minus utilisation, in ppm. Negative if over.
+
+    /* Running-job watchdog. advanceScheduler() checks the running schedule against its budget. */
+    boolean  setWatchdog(uint32_t g_pid, uint32_t ticks);   // Budget (in ticks) for a single run. 0 turns it off.
+    void     setOverrunHook(OverrunHook hook);              // Called from the ISR when an overrun is noticed.
+    uint32_t getOverrunCount(void);                         // How many overruns have there been?
+    uint8_t  getOverrunEvents(ScheduleOverrun* out, uint8_t max_events);  // Copies out the latest, oldest first.
+
+    /* Choosing between due schedules. See Note 8. */
+    boolean  setDispatchPolicy(uint8_t policy);             // False if there wasn't memory for the policy.
+    boolean  setSchedulePriority(uint32_t g_pid, uint16_t priority, uint16_t aging_rate);
+    boolean  setScheduleWeight(uint32_t g_pid, uint16_t weight);   // See Note 9.
+    uint32_t getMaxWait(uint32_t g_pid);                    // Longest wait (ticks) between release and dispatch.
+
+    /* Configured share (this schedule's weight over the total of all enabled schedules), and the share of
+     *   fair-share CPU time it has actually had since the policy was chosen. Both in ppm.
+     */
+    boolean  getFairShare(uint32_t g_pid, uint32_t* configured_ppm, uint32_t* achieved_ppm);
+
+    /* Mixed criticality. See Note 10. */
+    boolean  setCriticality(uint32_t g_pid, uint8_t level, uint8_t degrade_action, uint8_t stretch_factor);
+    void     setModeSwitch(uint32_t lateness_ticks, uint32_t recovery_ticks);
+    uint8_t  getCriticalityMode(void);
+    uint32_t getModeSwitchCount(void);
+
+    /* Load shedding. See Note 11. */
+    boolean  setLoadShedding(uint32_t backlog_micros);      // Zero turns it off. False if there wasn't memory.
+    boolean  setScheduleUtility(uint32_t g_pid, uint16_t utility);   // Zero means never shed.
+    uint32_t getShedCount(uint32_t g_pid);                  // Pass 0 for the total.
+
+    /* Static cyclic executive. See Note 12.
+     *   Builds a table from the current schedules and starts running it. Returns false (and leaves things
+     *   as they were) if a schedule has no execution estimate, the hyperperiod would be longer than
+     *   max_hyperperiod ticks, the jobs don't fit in their frames, or there isn't memory for the table.
+     */
+    boolean  buildCyclicSchedule(boolean snap_harmonic, uint32_t max_hyperperiod);
+    void     stopCyclicSchedule(void);                      // Back to dynamic dispatch.
+    uint32_t getCyclicMinorFrame(void);                     // In ticks. 0 if no table is running.
+    uint32_t getCyclicMajorFrame(void);                     // In ticks. 0 if no table is running.
+    uint32_t getCyclicOverruns(void);
+
+    /* Background work for passes where nothing is due. See Note 15. */
+    boolean  addIdleWork(IdleWorkPointer work, void* context);     // False if the queue is full.
+    boolean  removeIdleWork(IdleWorkPointer work, void* context);  // False if it wasn't queued.
+    void     setIdleBudget(uint32_t micros);                // Zero runs one step per idle pass.
+    uint8_t  getIdleWorkCount(void);
+    uint32_t getIdleRuns(void);
+
+    /* Deferred logging. See Note 16.
+     *   beginLogging() allocates a ring of at least the given number of records (rounded up to a power of
+     *   two), and queues flushLog() as background work if output isn't NULL. logEvent() is lock-free, and
+     *   may be called from callbacks, ISRs or other threads. Returns false if the record was dropped.
+     */
+    boolean  beginLogging(uint16_t slots, LogOutput output);
+    void     stopLogging(void);
+    boolean  logEvent(const char* format, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0);
+    uint16_t flushLog(uint16_t max_records);                // Formats and outputs up to max_records. Returns how many.
+    uint16_t readLog(LogRecord* out, uint16_t max_records); // Copies out (and consumes) raw records instead.
+    uint16_t getLogBacklog(void);                           // Records waiting to be read.
+    uint32_t getLogDropped(void);
+
     void serviceScheduledEvents(void);        // Execute any schedules that have come due.
     void advanceScheduler(void);              // Push all enabled schedules forward by one tick.
     
@@ -147,6 +989,15 @@ class Scheduler {
     char* dumpProfilingData(void);                               // Dumps profiling data for all schedules where the data exists.
     char* dumpProfilingData(uint32_t g_pid);                     // Dumps profiling data for the schedule with the given PID.
     char* dumpScheduleData(uint32_t g_pid, boolean active_only); // Dumps schedule data for all defined schedules. Active or not.
+    char* dumpCyclicSchedule(void);                              // Dumps the cyclic table, one frame per line.
+
+    /* Writes a SCHEDULER_DUMP_* dump to the given sink a piece at a time, from serviceScheduledEvents().
+     *   Pass 0 as g_pid for all schedules. Returns false if a dump is already running, or there wasn't
+     *   memory. See Note 17.
+     */
+    boolean startDump(uint8_t kind, uint32_t g_pid, DumpWrite write, DumpAvailable available);
+    boolean dumpInProgress(void);
+    void    cancelDump(void);
 
   private:
     boolean scheduleBeingProfiled(ScheduleItem *obj);
@@ -156,6 +1007,8 @@ class Scheduler {
     
     boolean alterSchedule(ScheduleItem *obj, uint32_t sch_period, int16_t recurrence, boolean auto_clear, FunctionPointer sch_callback);
 
+    boolean reserveHeaps(uint16_t schedules);
+    ScheduleItem* newScheduleItem(uint32_t sch_period, int16_t recurrence, boolean auto_clear, FunctionPointer sch_callback);
     boolean insertScheduleItemAfterNode(ScheduleItem *nu, ScheduleItem *prev);
     boolean insertScheduleItemAtEnd(ScheduleItem *obj);
     void destroyAllScheduleItems(void);
@@ -164,6 +1017,88 @@ class Scheduler {
     ScheduleItem* findNodeByPID(uint32_t g_pid);
     ScheduleItem* findNodeBeforeThisOne(ScheduleItem *obj);
     void destroyScheduleItem(ScheduleItem *r_node);
+
+    void indexScheduleItem(ScheduleItem *obj);
+    void unindexScheduleItem(ScheduleItem *obj);
+    void growPIDIndex(void);
+
+    void armTimeout(ScheduleItem *obj, uint32_t by_ms);
+    void linkIntoWheel(ScheduleItem *obj, uint8_t slot);
+    void unlinkFromWheel(ScheduleItem *obj);
+    void advanceTimeoutWheel(void);
+    uint32_t timeToWait(ScheduleItem *obj);
+
+    void advanceBudget(ScheduleItem *obj);
+    void dispatchBudgeted(ScheduleItem *obj);
+    boolean budgetReady(ScheduleItem *obj);
+    void refillSporadic(ScheduleItem *obj);
+    void clearBudgetData(ScheduleItem *obj);
+
+    ScheduleParams* getParams(ScheduleItem *obj);
+    uint32_t executionEstimate(ScheduleItem *obj);
+    uint32_t utilisationOf(uint32_t exec_micros, uint32_t sch_period);
+    uint32_t utilisationOf(ScheduleItem *obj);
+    uint32_t admissionBound(uint16_t schedules);
+    boolean  admits(ScheduleItem *replacing, uint32_t exec_micros, uint32_t sch_period);
+
+    void releaseSchedule(ScheduleItem *obj);
+    void clearRelease(ScheduleItem *obj);
+    void setEnabled(ScheduleItem *obj, boolean enabled);
+    ScheduleItem* pickNextSchedule(void);
+    uint32_t effectivePriority(ScheduleItem *obj);
+    uint32_t maxWait(ScheduleItem *obj);
+    void chargeFairShare(ScheduleItem *obj, uint32_t cost_micros);
+    boolean suspended(ScheduleItem *obj);
+    uint32_t periodOf(ScheduleItem *obj);
+    boolean criticalityWatched(ScheduleItem *obj);
+    void raiseCriticality(uint8_t level);
+    void checkCriticality(ScheduleItem *obj, uint32_t exec_micros, uint32_t lateness);
+    void readyPush(ScheduleItem *obj);
+    void shedPush(ScheduleItem *obj);
+    void shedRemove(ScheduleItem *obj);
+    void shedLoad(void);
+    uint32_t cyclicPeriod(ScheduleItem *obj, uint32_t base, boolean snap_harmonic);
+    boolean inCyclicSchedule(ScheduleItem *obj);
+    ScheduleItem* nextCyclicJob(void);
+
+    boolean heapGrow(ScheduleHeap *heap, uint16_t min_size);
+    void heapFree(ScheduleHeap *heap);
+    uint16_t* heapPos(ScheduleHeap *heap, ScheduleItem *obj);
+    boolean heapBefore(ScheduleHeap *heap, ScheduleItem *a, ScheduleItem *b);
+    void heapPush(ScheduleHeap *heap, ScheduleItem *obj);
+    void heapRemove(ScheduleHeap *heap, ScheduleItem *obj);
+    void heapSiftUp(ScheduleHeap *heap, uint16_t idx);
+    void heapSiftDown(ScheduleHeap *heap, uint16_t idx);
+    void runSchedule(ScheduleItem *obj, void** contexts, uint16_t count);
+    uint16_t collectBatch(ScheduleItem *obj, ScheduleItem** batch, void** contexts);
+    void finishRun(ScheduleItem *obj);
+    void runIdleWork(uint32_t origin_time);
+    boolean takeLogRecord(LogRecord* out);
+    int  formatScheduleRow(ScheduleItem *obj, char* buf, size_t len);
+    int  formatProfilingRow(ScheduleItem *obj, char* buf, size_t len);
+    int  formatProfilerTrailer(char* buf, size_t len);
+    boolean nextDumpRow(DumpJob* job);
+    void advanceDump(void);
+    void advancePwm(void);
+    uint8_t runPosted(void);
+    boolean hasDeadline(ScheduleItem *obj);
+    void setTimeToWait(ScheduleItem *obj, uint32_t ticks);
+    boolean sampleThisRun(ScheduleProfile *p_data);
+    void recordUnsampledRun(ScheduleProfile *p_data);
+    uint64_t scaledTotalTime(ScheduleProfile *p_data);
+    uint32_t samplingConfidence(ScheduleProfile *p_data);
+    void recordProfile(ScheduleItem *obj, uint32_t exec_micros, uint32_t lateness, uint32_t now);
+    void detectAnomalies(ScheduleItem *obj, uint32_t exec_micros, uint32_t now);
+    void logAnomaly(uint32_t pid, uint32_t now, uint32_t observed, uint32_t expected, uint8_t kind);
+    uint32_t rankValue(ScheduleItem *obj, uint8_t metric, uint64_t total_time);
+    boolean copyProfile(ScheduleItem *obj, ScheduleProfile* out);
+    void writeMetrics(struct sch_metrics_sink_t* sink);
+    void writeMetricLabels(struct sch_metrics_sink_t* sink, ScheduleItem *obj, const char* le);
+    void writeMetricHistogram(struct sch_metrics_sink_t* sink, const char* family, uint8_t histogram);
+
+    void startWatchdog(ScheduleItem *obj);
+    void stopWatchdog(void);
+    void checkWatchdog(void);
     
     boolean delaySchedule(ScheduleItem *obj, uint32_t by_ms);
 };
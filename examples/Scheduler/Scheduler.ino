@@ -77,26 +77,45 @@ void printProfilingData() {
 
 /**
 * Maybe we have an IR remote, or a piezo buzzer on this pin...
+* Called from the timer ISR by the scheduler's PWM engine whenever its outputs change. Channel 0 is the piezo.
 */
-void software_pwm() {
-	digitalWrite(PIEZO_PIN, !(digitalRead(PIEZO_PIN) == HIGH));
+void software_pwm(uint32_t mask) {
+	digitalWrite(PIEZO_PIN, (mask & 0x01) ? HIGH : LOW);
 }
 
 
 /**
-* This function will insert a new schedule entry that will cause a tone on PIEZO_PIN.
+* Silences the piezo.
+*/
+void beep_off() {
+	scheduler.setPwmDuty(0, 0);
+}
+
+
+/**
+* This function will cause a tone on PIEZO_PIN, and set a timeout to end it.
 */
 void beep_via_software_pwm() {
-	scheduler.createSchedule(1, 400, false, software_pwm);  // Output a short-duration 500Hz tone at PIEZO_PIN.
+	scheduler.setPwmDuty(0, 1);                   // Half of a two-tick period: a 500Hz tone at PIEZO_PIN...
+	scheduler.createTimeout(400, true, beep_off);  // ...for 400ms.
 }
 
 
 /**
-* This function will read an analog pin and write the result to the serial port.
+* Sends a deferred log line to the serial port. Called from idle time, not from the callbacks that logged.
+*/
+void serial_log_output(const char* line) {
+	Serial.println(line);
+}
+
+
+/**
+* This function will read an analog pin and log the result. The formatting and serial
+*  output happen later, when the scheduler has nothing else to do.
 */
 void analog_read_fxn() {
 	analog_data = analogRead(ANALOG_PIN);
-	Serial.println(String(analog_data, 16));
+	scheduler.logEvent("analog %lx", analog_data);
 }
 
 
@@ -129,6 +148,9 @@ void setup() {
   pinMode(PIEZO_PIN, OUTPUT);
   pinMode(ANALOG_PIN, INPUT);
   
+  scheduler.beginLogging(16, serial_log_output);   // Room for 15 log records waiting to be printed.
+  scheduler.beginPwm(1, software_pwm);             // One bit of resolution is all a square wave needs.
+
   scheduler.createSchedule(250, 8, true, led_schedule_service);                        // Flash the LED four times at 2Hz. Auto-clears.
   analog_read_pid   = scheduler.createSchedule(1500, -1, false, analog_read_fxn);      // Read analog data every 1.5 seconds.
   profiler_dump_pid = scheduler.createSchedule(10000, -1, false, printProfilingData);  // Print profiling data once every 10 seconds.